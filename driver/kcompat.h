@@ -104,6 +104,10 @@
 #endif
 #endif
 
+#ifndef __always_inline
+#define __always_inline	inline __attribute__((always_inline))
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,24)
 typedef unsigned long uintptr_t;
 #endif
@@ -540,6 +544,7 @@ int kcompat_no_printk(const char *fmt, ...)
 #define MODULE_PARM_long(x)	MODULE_PARM(x, "l")
 #define MODULE_PARM_ulong(x)	MODULE_PARM(x, "l")
 #define MODULE_PARM_bool(x)	MODULE_PARM(x, "i")
+#define MODULE_PARM_charp(x)	MODULE_PARM(x, "s")
 #define module_param(x,y,z)	MODULE_PARM_##y(x)
 #else
 #include <linux/moduleparam.h>
@@ -2085,6 +2090,14 @@ extern struct device *(*kcompat_device_create_2_6_19)(struct class *,
 #define KCOMPAT_USE_CLASS_DEV_GROUPS
 #endif
 
+/*
+ * The 'probe_type' member of 'struct device_driver' appeared in 4.2.
+ * Define 'KCOMPAT_HAVE_DRIVER_PROBE_TYPE' if it exists.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,2,0)
+#define KCOMPAT_HAVE_DRIVER_PROBE_TYPE
+#endif
+
 /*
  * `csdev_printk(level, cd, format, ...)` and friends are our own
  * invention as a convenient replacement for `dev_printk` and friends
@@ -2927,6 +2940,59 @@ static inline int completion_done(struct completion *x)
  * they are only used by the block layer so not really needed for drivers.
  */
 
+/* Define KCOMPAT_HAVE_LINUX_KTHREAD_H if kernel has <linux/kthread.h>. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,4)
+#define KCOMPAT_HAVE_LINUX_KTHREAD_H
+#endif
+
+#ifdef KCOMPAT_HAVE_LINUX_KTHREAD_H
+#include <linux/kthread.h>
+#endif
+
+/* Define KCOMPAT_HAVE_LINUX_WORKQUEUE_H if kernel has <linux/workqueue.h>. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,5,41)
+#define KCOMPAT_HAVE_LINUX_WORKQUEUE_H
+#endif
+
+#ifdef KCOMPAT_HAVE_LINUX_WORKQUEUE_H
+#include <linux/workqueue.h>
+
+/*
+ * Work functions have been passed a pointer to the work_struct since
+ * kernel version 2.6.20.  Before that, pass it as the data pointer.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+#define KCOMPAT_INIT_WORK(_work, _func) \
+	INIT_WORK((_work), (void (*)(void *))(_func), (_work))
+#else
+#define KCOMPAT_INIT_WORK(_work, _func) INIT_WORK((_work), (_func))
+#endif
+
+/*
+ * cancel_work_sync(work) was added in kernel version 2.6.22.  Before
+ * that, wait for the work to run instead.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,22)
+static inline int cancel_work_sync(struct work_struct *work)
+{
+	flush_scheduled_work();
+	return 0;
+}
+#endif
+
+/*
+ * system_long_wq, for work items that may run for a long time, was added
+ * in kernel version 2.6.36.  Before that, use the default workqueue.
+ *
+ * Define kcompat_queue_long_work(work) to queue such work items.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+#define kcompat_queue_long_work(work)	queue_work(system_long_wq, (work))
+#else
+#define kcompat_queue_long_work(work)	schedule_work(work)
+#endif
+#endif	/* KCOMPAT_HAVE_LINUX_WORKQUEUE_H */
+
 /* msleep, ssleep and a few conversions between jiffies and standard time
  * units. */
 #include <linux/delay.h>
@@ -3091,6 +3157,11 @@ static inline unsigned long usecs_to_jiffies(const unsigned int u)
 #define time_is_after_eq_jiffies64(a)	time_before_eq64(get_jiffies_64(), a)
 #endif
 
+/* Define ndelay() in terms of udelay() if the kernel does not have it. */
+#ifndef ndelay
+#define ndelay(nsecs)	udelay(((nsecs) + 999) / 1000)
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,7)
 static inline void kcompat_msleep(unsigned int msecs)
 {
@@ -3105,6 +3176,23 @@ static inline void kcompat_msleep(unsigned int msecs)
 #define msleep(msecs)	kcompat_msleep(msecs)
 #endif
 
+/*
+ * usleep_range() was added in kernel version 2.6.36.  msleep() sleeps for
+ * at least a jiffy, so delay for sub-millisecond ranges instead.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,36)
+static inline void kcompat_usleep_range(unsigned long min, unsigned long max)
+{
+	if (min < 1000) {
+		udelay(min);
+	} else {
+		msleep((min + 999) / 1000);
+	}
+}
+#undef usleep_range
+#define usleep_range(min, max)	kcompat_usleep_range(min, max)
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,9)
 static inline long msleep_interruptible(unsigned int msecs)
 {
@@ -3294,6 +3382,26 @@ static inline s64 kcompat_ktime_to_ns(const ktime_t kt)
 #define ktime_to_ns(kt) kcompat_ktime_to_ns(kt)
 #endif
 
+/* ktime_to_us() was added in kernel version 2.6.22. */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,22)
+#include <asm/div64.h>
+
+static inline s64 ktime_to_us(const ktime_t kt)
+{
+	s64 ns = ktime_to_ns(kt);
+	u64 us;
+
+	if (ns < 0) {
+		us = -ns;
+		do_div(us, 1000);
+		return -(s64)us;
+	}
+	us = ns;
+	do_div(us, 1000);
+	return us;
+}
+#endif
+
 #endif /* ifdef KCOMPAT_HAVE_KTIME */
 
 /* Check for existence of hrtimer API and API changes. */
@@ -4213,6 +4321,11 @@ static inline int kcompat_access_ok(const void __user *addr, size_t size)
 }
 #endif
 
+/* u64_to_user_ptr() was added in kernel version 4.6. */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,6,0)
+#define u64_to_user_ptr(x)	((void __user *)(unsigned long)(x))
+#endif
+
 /*
  * Simplified atomic barriers introduced in kernel version 3.16.
  */
@@ -62,6 +62,12 @@
 static inline int pci_domain_nr(struct pci_bus *bus) { return 0; }
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,10)
+/* pci_save_state() and pci_restore_state() have a 'buffer' parameter
+ * pointing to 16 dwords. */
+#define KCOMPAT_PCI_SAVE_STATE_HAS_BUFFER
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,4,4)
 
 struct pci_pool {	/* the pool */
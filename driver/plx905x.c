@@ -79,6 +79,8 @@
 #include <asm/uaccess.h>
 #endif
 
+#include "plx905x.h"
+
 /*
  * More driver information:
  */
@@ -99,12 +101,43 @@
  */
 #define DEVICE_PREFIX PLX905X_EEPROM_DEVICE_PREFIX
 
+/*
+ * Minor device number and name of the control device:
+ */
+#define PLX905X_CTL_MINOR	PLX905X_MAX_DEVICES
+#define CTL_DEVICE_NAME		DEVICE_PREFIX "ctl"
+
 /*
  * Bit number to indicate device name registered with devfs for older
  * kernels if supported.
  */
 #define PLX905X_STATUS_DEVNAME_REGISTERED	0
 
+/*
+ * Bit number to indicate the RAM copy of the EEPROM contents is valid.
+ * If not set, individual words of the RAM copy may still be valid (see
+ * the 'cache_filled' bitmap).
+ */
+#define PLX905X_STATUS_CACHE_VALID	1
+
+/*
+ * Bit number to indicate the shadow copy of the CNTRL register needs to be
+ * refreshed from the hardware before the next EEPROM command.
+ */
+#define PLX905X_STATUS_CNTRL_STALE	2
+
+/*
+ * Bit number to indicate the EEPROM has been write-enabled by an EWEN
+ * command and not since write-disabled.
+ */
+#define PLX905X_STATUS_WRITE_ENABLED	3
+
+/*
+ * Bit number to indicate the PCI device has been removed.  Open files
+ * can no longer access it.
+ */
+#define PLX905X_STATUS_GONE	4
+
 /*
  * Redefine pr_debug macro to use "debug" module parameter.
  */
@@ -118,6 +151,19 @@
 #define pr_debuglvl(lvl, fmt, args...)					\
 	(debug >= (lvl) ? printk(KERN_DEBUG pr_fmt(fmt), ##args) : 0)
 
+/*
+ * Define plxdev_* macros like pr_* but naming the PCI device, for messages
+ * about a device that may not have a class device yet.
+ */
+#define plxdev_printk(level, d, fmt, args...)				\
+	printk(level pr_fmt("%s: " fmt), pci_name((d)->pcidev), ##args)
+#define plxdev_err(d, fmt, args...)					\
+	plxdev_printk(KERN_ERR, d, fmt, ##args)
+#define plxdev_warn(d, fmt, args...)					\
+	plxdev_printk(KERN_WARNING, d, fmt, ##args)
+#define plxdev_info(d, fmt, args...)					\
+	plxdev_printk(KERN_INFO, d, fmt, ##args)
+
 /*
  * Redefine csdev_dbg macro (an invention of kcompat.h) to use "debug" module
  * parameter.
@@ -142,7 +188,6 @@
 #define PLX9060ES_DEVICE_ID	0x906E
 #define PLX9080_DEVICE_ID	0x9080
 #define PLX9656_DEVICE_ID	0x9656
-#define DEFAULT_DEVICE_ID	PLX9050_DEVICE_ID
 
 #define PLX9054_PCIHIDR	0x70
 #define PLX9054_PCIHIDR_VALUE	0x905410B5
@@ -161,6 +206,8 @@
 #define CS56_EEPROM_ADDR_LEN	8
 #define CS66_EEPROM_SIZE	512
 #define CS66_EEPROM_ADDR_LEN	8
+/* Most address bits clocked while looking for the dummy bit. */
+#define EEPROM_MAX_ADDR_LEN	12
 
 #define PLX9050_CNTRL	0x50
 #define PLX9054_CNTRL	0x6C
@@ -169,11 +216,145 @@
 #define EE_DI	0x04000000	/* from EEPROM's point of view */
 #define EE_DO	0x08000000
 #define EE_DOE	0x80000000	/* for PCI9056 */
+#define EE_RELOAD	0x20000000	/* reload configuration registers */
 
 #define PLX9050_EEMASK	(EE_SK | EE_CS | EE_DI | EE_DO)
 #define PLX9056_EEMASK	(EE_SK | EE_CS | EE_DI | EE_DO | EE_DOE)
 
+/* Maximum delay allowed in a timing parameter (nanoseconds). */
+#define EEPROM_MAX_DELAY_NS	100000
+
+/* Shortest delay (nanoseconds) worth sleeping for instead of spinning. */
+#define EEPROM_SLEEP_MIN_NS	10000
+
+/*
+ * Programming cycle time (tWP) prediction and polling limits.  The
+ * initial prediction is at the low end of typical 93Cx6 write times.
+ */
+#define EEPROM_TWP_INIT_US	2000
+#define EEPROM_TWP_MIN_US	100
+#define EEPROM_TWP_POLL_US	50	/* first poll interval */
+#define EEPROM_TWP_POLL_MAX_US	1000	/* maximum poll interval */
+#define EEPROM_TWP_TIMEOUT_MS	50
+
+/* Number of CNTRL accesses per batch and number of batches to time. */
+#define CALIBRATE_LOOPS		32
+#define CALIBRATE_BATCHES	4
+
+/* Time allowed for the PLX chip to reload its configuration (ms). */
+#define PLX905X_RELOAD_MS	20
+
+/* Maximum number of words fetched by one sequential READ command. */
+#define EEPROM_SEQ_READ_WORDS	32
+
+/*
+ * Target time (us) for which a read transfer holds the mutex between
+ * giving other users a look in.  Writes give way after each word.
+ */
+#define EEPROM_HOLD_BUDGET_US	200
+
+/*
+ * Clock training: number of words read and number of passes to check
+ * stability at each clock rate, search resolution, and safety margin
+ * added to the fastest stable SK half-period (percent, with a minimum).
+ * Training never goes faster than the "fast" timing profile, which is at
+ * the 93C46/56/66 datasheet limits.
+ */
+#define TRAIN_WORDS		16
+#define TRAIN_PASSES		4
+#define TRAIN_RES_NS		10
+#define TRAIN_MARGIN_PCT	50
+#define TRAIN_MARGIN_MIN_NS	50
+
+/*
+ * EEPROM access engines.  The PCI9030, PCI9054, PCI9056 and PCI9656 can
+ * also access the EEPROM through the PCI VPD capability, with the chip's
+ * own state machine clocking the EEPROM a dword at a time.
+ */
+#define PLX905X_ENGINE_BITBANG	0
+#define PLX905X_ENGINE_VPD	1
+
+/*
+ * VPD polling: spin briefly (long enough for a dword read), then sleep
+ * between polls while a write is programmed.
+ */
+#define VPD_SPIN_POLLS		20
+#define VPD_SPIN_US		5
+#define VPD_POLL_US		200
+#define VPD_TIMEOUT_MS		100
+
+/*
+ * Precomputed bit-bang waveforms.  Each step is a code holding the states
+ * of the CS, SK and DI lines and the delay class to use after writing them
+ * to CNTRL.  The longest command is WRAL or WRITE with 8 address bits.
+ */
+#define WAVE_SK			0x01
+#define WAVE_DI			0x02	/* also DOE */
+#define WAVE_CS			0x04
+#define WAVE_LINES		0x07
+#define WAVE_DLY_SHIFT		3
+#define WAVE_DLY_SK_LOW		(0 << WAVE_DLY_SHIFT)
+#define WAVE_DLY_SK_HIGH	(1 << WAVE_DLY_SHIFT)
+#define WAVE_DLY_CS_LOW		(2 << WAVE_DLY_SHIFT)
+#define WAVE_MAX_STEPS		(2 * (3 + CS66_EEPROM_ADDR_LEN + 16) + 1)
+
+/*
+ * Microwire bus timing in nanoseconds.
+ */
+struct plx905x_timing {
+	unsigned int sk_low;	/* SK low time, including DI and CS setup */
+	unsigned int sk_high;	/* SK high time */
+	unsigned int cs_low;	/* CS low time between commands */
+	unsigned int do_valid;	/* SK rising edge to DO valid */
+};
+
+/*
+ * Delays in nanoseconds actually used after each CNTRL register access,
+ * derived from the timing parameters and the measured bus access times.
+ */
+struct plx905x_delays {
+	unsigned int sk_low;	/* after SK falling edge */
+	unsigned int sk_high;	/* after SK rising edge */
+	unsigned int cs_low;	/* after CS falling edge */
+	unsigned int dummy;	/* extra delay before checking dummy bit */
+	unsigned int sample;	/* after SK rising edge before sampling DO */
+};
+
+struct plx905x_wave {
+	unsigned int len;
+	u8 step[WAVE_MAX_STEPS];
+};
+
+struct plx905x_timing_profile {
+	const char *name;
+	struct plx905x_timing timing;
+};
+
+/* EEPROM access engine names, indexed by engine number. */
+static const char * const plx905x_engine_names[] = {
+	[PLX905X_ENGINE_BITBANG] = "bitbang",
+	[PLX905X_ENGINE_VPD] = "vpd",
+};
+
+/*
+ * Timing profiles.  The first one is the default and matches the timing
+ * used by earlier versions of the driver (SK about 250 kHz).  The "fast"
+ * profile is at the limits of a 93C46/56/66 running at 5 V (SK about
+ * 2 MHz, with the 250 ns minimum SK low and high times).
+ */
+static const struct plx905x_timing_profile plx905x_timing_profiles[] = {
+	{ "safe",	{ 2000, 2000, 2000, 3000 } },
+	{ "standard",	{ 500, 500, 1000, 500 } },
+	{ "fast",	{ 250, 250, 250, 250 } },
+};
+
+struct plx905x_file;
+struct plx905x_bitops;
+
 struct plx905x_dev {
+	struct kref kref;
+	unsigned int minor;
+	char name[sizeof(DEVICE_PREFIX) + 10];
 	struct pci_dev *pcidev;
 	resource_size_t iophys;
 	resource_size_t iosize;
@@ -189,10 +370,69 @@ struct plx905x_dev {
 	unsigned int iospace;
 	unsigned int cntrl;
 	unsigned int cntrl_eemask;
+	u32 cntrl_shadow;
+	const struct plx905x_bitops *bitops;
+	u32 wave_lines[WAVE_LINES + 1];
+	struct plx905x_wave wave_ewen;
+	struct plx905x_wave wave_ewds;
 	size_t eeprom_size;
 	unsigned int eeprom_addr_len;
 	struct mutex mutex;
 	unsigned long status;
+	unsigned int use_cache;
+	const char *timing_name;
+	struct plx905x_timing timing;
+	unsigned int clock_ns;
+	struct plx905x_delays delay;
+	unsigned int bus_read_ns;
+	unsigned int bus_write_ns;
+	unsigned int twp_us;
+	unsigned long io_retries;
+	unsigned long io_errors;
+#ifdef KCOMPAT_HAVE_KTIME
+	ktime_t hold_start;
+#else
+	unsigned long hold_start;
+#endif
+	unsigned int max_hold_us;
+	unsigned int write_sessions;
+	unsigned long write_gen;
+	struct plx905x_file *lock_owner;
+	wait_queue_head_t lock_wait;
+	struct list_head orphans;
+	unsigned int engine;
+	unsigned int model;
+	int engine_sel;
+	size_t detect_min;
+	size_t detect_max;
+	struct completion ready;
+#ifdef KCOMPAT_HAVE_LINUX_WORKQUEUE_H
+	struct work_struct bringup_work;
+#endif
+	int vpd_cap;
+	unsigned int vpd_swap;
+#ifdef KCOMPAT_PCI_SAVE_STATE_HAS_BUFFER
+	u32 saved_config[16];
+#endif
+	u16 cache[CS66_EEPROM_SIZE / 2];
+	unsigned long cache_filled[(CS66_EEPROM_SIZE / 2 + BITS_PER_LONG - 1) /
+				   BITS_PER_LONG];
+};
+
+/*
+ * Per open file information.  During a write session, 'image' holds the
+ * EEPROM contents as seen through the file, and 'orig' holds the contents
+ * as last read from or programmed into the EEPROM.  Words that differ are
+ * programmed when the session is flushed.  A file closed while another
+ * file holds the user-space access lock stays on the device's 'orphans'
+ * list until its session can be ended.
+ */
+struct plx905x_file {
+	struct plx905x_dev *dev;
+	unsigned int session;
+	struct list_head orphan;
+	u16 image[CS66_EEPROM_SIZE / 2];
+	u16 orig[CS66_EEPROM_SIZE / 2];
 };
 
 /*
@@ -255,510 +495,3517 @@ static unsigned int subdevice = PCI_ANY_ID;
 module_param(subdevice, uint, 0444);
 MODULE_PARM_DESC(subdevice, "PCI Subsystem Device ID (optional)");
 
+static unsigned int async = 1;
+module_param(async, uint, 0444);
+MODULE_PARM_DESC(async,
+		 "Probe devices and bring up EEPROM access in the background "
+		 "(default 1)");
+
 static unsigned int instance = 0;
 module_param(instance, uint, 0444);
 MODULE_PARM_DESC(instance,
-		 "Instance of PCI Vendor/Device/Subsystem IDs (default 0)");
+		 "Obsolete and ignored; all matching devices are used");
 
 static unsigned int eeprom = 0;
 module_param(eeprom, uint, 0444);
 MODULE_PARM_DESC(eeprom,
 		 "EEPROM type 46 (1024-bit), 56 (2048-bit), 66 (4096-bit) "
-		 "(default depends on PLX device)");
+		 "(default detected or depends on PLX device)");
 
 static unsigned int plx=0;
 module_param(plx, uint, 0444);
 MODULE_PARM_DESC(plx,
 		 "PLX chip type 0x9030, 0x9050, 0x9052 (equivalent to 0x9050), "
-		 "0x9054, 0x9056, 0x9060, 0x9080, 0x9656 (default 0x9050)");
+		 "0x9054, 0x9056, 0x9060, 0x9080, 0x9656 (default any)");
+
+static unsigned int cache = 1;
+module_param(cache, uint, 0444);
+MODULE_PARM_DESC(cache,
+		 "Keep a RAM copy of the EEPROM contents (0=no, 1=yes) "
+		 "(default 1)");
+
+static unsigned int warmup = 1;
+module_param(warmup, uint, 0444);
+MODULE_PARM_DESC(warmup,
+		 "Fill the RAM copy of the EEPROM contents in the background "
+		 "(0=no, 1=yes) (default 1)");
+
+static char *timing = "safe";
+module_param(timing, charp, 0444);
+MODULE_PARM_DESC(timing,
+		 "EEPROM timing profile safe, standard, fast (default safe)");
+
+static unsigned int calibrate = 1;
+module_param(calibrate, uint, 0444);
+MODULE_PARM_DESC(calibrate,
+		 "Shorten EEPROM delays by measured bus access time "
+		 "(0=no, 1=yes) (default 1)");
+
+static unsigned int train = 0;
+module_param(train, uint, 0444);
+MODULE_PARM_DESC(train,
+		 "Find the fastest stable EEPROM clock at load (0=no, 1=yes) "
+		 "(default 0)");
+
+static unsigned int clock_ns = 0;
+module_param(clock_ns, uint, 0444);
+MODULE_PARM_DESC(clock_ns,
+		 "EEPROM clock half-period in ns, overriding timing and train "
+		 "(default 0=not set)");
+
+static unsigned int retries = 2;
+module_param(retries, uint, 0644);
+MODULE_PARM_DESC(retries,
+		 "Number of slower EEPROM clock retries after an I/O error "
+		 "(default 2)");
+
+static char *engine = "auto";
+module_param(engine, charp, 0444);
+MODULE_PARM_DESC(engine,
+		 "EEPROM access engine auto, bitbang, vpd (default auto)");
 
 /*
  * Sysfs class for 2.6:
  */
 static struct class *plx905x_class;
 
-static struct plx905x_dev plx905x_device = {0};
+/*
+ * Devices indexed by minor device number.
+ */
+static struct plx905x_dev *plx905x_devs[PLX905X_MAX_DEVICES];
+static DEFINE_MUTEX(plx905x_devs_mutex);
+
+/*
+ * Control device.
+ */
+#ifdef KCOMPAT_NO_CLASS_DEVICE
+static struct device *plx905x_ctl_csdev;
+#else
+static struct class_device *plx905x_ctl_csdev;
+#endif
+static unsigned long plx905x_ctl_status;
+static struct file_operations plx905x_ctl_fops;
 
-static u32
-cntrl_read(struct plx905x_dev *dev)
+/*
+ * PCI IDs.  These are the factory defaults for the supported PLX chips.
+ * The spare entry before the terminating entry is filled in from module
+ * parameters.
+ */
+static struct pci_device_id plx905x_pci_table[] = {
+	{ PLX_VENDOR_ID, PLX9030_DEVICE_ID, PCI_ANY_ID, PCI_ANY_ID, 0, 0, 0 },
+	{ PLX_VENDOR_ID, PLX9050_DEVICE_ID, PCI_ANY_ID, PCI_ANY_ID, 0, 0, 0 },
+	{ PLX_VENDOR_ID, PLX9054_DEVICE_ID, PCI_ANY_ID, PCI_ANY_ID, 0, 0, 0 },
+	{ PLX_VENDOR_ID, PLX9056_DEVICE_ID, PCI_ANY_ID, PCI_ANY_ID, 0, 0, 0 },
+	{ PLX_VENDOR_ID, PLX9060_DEVICE_ID, PCI_ANY_ID, PCI_ANY_ID, 0, 0, 0 },
+	{ PLX_VENDOR_ID, PLX9060SD_DEVICE_ID, PCI_ANY_ID, PCI_ANY_ID,
+	  0, 0, 0 },
+	{ PLX_VENDOR_ID, PLX9060ES_DEVICE_ID, PCI_ANY_ID, PCI_ANY_ID,
+	  0, 0, 0 },
+	{ PLX_VENDOR_ID, PLX9080_DEVICE_ID, PCI_ANY_ID, PCI_ANY_ID, 0, 0, 0 },
+	{ PLX_VENDOR_ID, PLX9656_DEVICE_ID, PCI_ANY_ID, PCI_ANY_ID, 0, 0, 0 },
+	{ 0 },	/* from module parameters */
+	{ 0 }
+};
+
+/*
+ * CNTRL register accessors.  The 'pio' parameter must be a compile-time
+ * constant in the bit-bang engines, which are generated separately for
+ * port I/O and MMIO so that the BAR type is not tested on every edge.
+ */
+static __always_inline u32
+__cntrl_read(struct plx905x_dev *dev, const int pio)
 {
-	if (dev->iospace == IORESOURCE_IO) {
+	if (pio) {
 		return inl(dev->u.iobase + dev->cntrl);
 	} else {
 		return readl(dev->u.mmbase + dev->cntrl);
 	}
 }
 
-static void
-cntrl_write(struct plx905x_dev *dev, u32 data)
+static __always_inline void
+__cntrl_write(struct plx905x_dev *dev, u32 data, const int pio)
 {
-	if (dev->iospace == IORESOURCE_IO) {
+	if (pio) {
 		outl(data, dev->u.iobase + dev->cntrl);
 	} else {
 		writel(data, dev->u.mmbase + dev->cntrl);
 	}
+	dev->cntrl_shadow = data;
+}
+
+static u32
+cntrl_read(struct plx905x_dev *dev)
+{
+	return __cntrl_read(dev, dev->iospace == IORESOURCE_IO);
 }
 
-/* Assert CS and send start bit. */
 static void
-eeprom_start_cmd(struct plx905x_dev *dev, u32 *cntrl)
+cntrl_write(struct plx905x_dev *dev, u32 data)
 {
-	u32 cn;
+	__cntrl_write(dev, data, dev->iospace == IORESOURCE_IO);
+}
 
-	cn = cntrl_read(dev);
-	cn = (cn & ~EE_SK) | ((EE_CS | EE_DI | EE_DOE) & dev->cntrl_eemask);
-						/* SK=0, CS=1, DI=1, DOE1=1 */
-	cntrl_write(dev, cn);
-	udelay(2);
-	cn |= EE_SK;				/* SK=1 */
-	cntrl_write(dev, cn);
-	udelay(2);
-	*cntrl = cn;
+/*
+ * Get the current CNTRL register value from the shadow copy, which holds
+ * the value last written.  The other (non-EEPROM) bits of CNTRL may be
+ * changed by the local bus side of the PLX chip or by other software, so
+ * the shadow copy is refreshed from the hardware when marked as stale.
+ * It is marked as stale on each entry to the driver's read and write
+ * file operations, so that at most one CNTRL read is needed per call
+ * rather than one per EEPROM command.
+ */
+static u32
+cntrl_get(struct plx905x_dev *dev)
+{
+	if (test_and_clear_bit(PLX905X_STATUS_CNTRL_STALE, &dev->status)) {
+		dev->cntrl_shadow = cntrl_read(dev);
+	}
+	return dev->cntrl_shadow;
 }
 
-/* Deassert CS.  Assumes *cntrl is valid. */
-static void
-eeprom_end_cmd(struct plx905x_dev *dev, u32 *cntrl)
+/*
+ * Compare a string against a name.  Ignores trailing newline in the string.
+ */
+static int
+plx905x_name_eq(const char *str, const char *name)
 {
-	u32 cn = *cntrl;
+	size_t len = strlen(str);
 
-	cn &= ~((EE_CS | EE_SK | EE_DI | EE_DOE) & dev->cntrl_eemask);
-						/* CS=0, SK=0, DI=0, DOE=0 */
-	cntrl_write(dev, cn);
-	udelay(2);
-	*cntrl = cn;
+	if (len && str[len - 1] == '\n') {
+		len--;
+	}
+	return strlen(name) == len && strncmp(name, str, len) == 0;
 }
 
-/* Send a few bits.  Assumes *cntrl is valid. */
-static void
-eeprom_put_bits(struct plx905x_dev *dev, u32 *cntrl, unsigned int bits,
-		unsigned int nbits)
+/*
+ * Find timing profile by name.  Ignores trailing newline in the name.
+ */
+static const struct plx905x_timing_profile *
+plx905x_find_timing_profile(const char *name)
 {
-	u32 cn = *cntrl;
+	unsigned int i;
 
-	while (nbits--) {
-		if (bits & (1 << nbits)) {
-			cn |= ((EE_DI | EE_DOE) & dev->cntrl_eemask);
-							/* DI=1 */
-		} else {
-			cn &= ~((EE_DI | EE_DOE) & dev->cntrl_eemask);
-							/* DI=0 */
+	for (i = 0; i < ARRAY_SIZE(plx905x_timing_profiles); i++) {
+		if (plx905x_name_eq(name, plx905x_timing_profiles[i].name)) {
+			return &plx905x_timing_profiles[i];
 		}
-		cn &= ~EE_SK;			/* SK=0 */
-		cntrl_write(dev, cn);
-		udelay(2);
-		cn |= EE_SK;			/* SK=1 */
-		cntrl_write(dev, cn);
-		udelay(2);
 	}
-	*cntrl = cn;
+	return NULL;
 }
 
-/* Wait for programming cycle to complete. */
+/*
+ * Find EEPROM access engine by name.  Ignores trailing newline in the name.
+ * Returns the engine number or -1 if not found.
+ */
 static int
-eeprom_wait_prog(struct plx905x_dev *dev)
+plx905x_find_engine(const char *name)
 {
-	unsigned long old_jiffies;
-	unsigned long timeout;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(plx905x_engine_names); i++) {
+		if (plx905x_name_eq(name, plx905x_engine_names[i])) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Measure the time taken to read and write the CNTRL register.  The
+ * minimum of several batches is used to reduce the effect of interrupts
+ * and preemption.  The register is written back with the value read, so
+ * the EEPROM control lines do not change.
+ */
+static void
+plx905x_calibrate(struct plx905x_dev *dev)
+{
+#ifdef KCOMPAT_HAVE_KTIME
+	ktime_t t0;
+	u32 ns;
+	u32 rd_ns = ~0U;
+	u32 wr_ns = ~0U;
 	u32 cn;
-	int retval;
+	unsigned int batch;
+	unsigned int i;
 
-	timeout = 1 + (((50 * HZ) + 999) / 1000);	/* ~50ms */
 	cn = cntrl_read(dev);
-	cn = (cn & ~EE_SK) | ((EE_CS | EE_DI | EE_DOE) & dev->cntrl_eemask);
-						/* SK=0, CS=1, DI=1, DOE=1 */
-	cntrl_write(dev, cn);
-	old_jiffies = jiffies;
-	retval = -EIO;
-	udelay(2);
-	do {
-		schedule();
-		cn = cntrl_read(dev);
-		if ((cn & EE_DO) != 0) {
-			/* Cycle complete.  Clear ready status (optional). */
-			cn |= EE_SK;		/* SK=1 */
+	for (batch = 0; batch < CALIBRATE_BATCHES; batch++) {
+		t0 = ktime_get();
+		for (i = 0; i < CALIBRATE_LOOPS; i++) {
+			cn = cntrl_read(dev);
+		}
+		ns = (u32)ktime_to_ns(ktime_sub(ktime_get(), t0));
+		if (ns < rd_ns) {
+			rd_ns = ns;
+		}
+		/* The final read flushes any posted writes. */
+		t0 = ktime_get();
+		for (i = 0; i < CALIBRATE_LOOPS; i++) {
 			cntrl_write(dev, cn);
-			udelay(2);
-			retval = 0;
-			break;
 		}
-	} while (jiffies - old_jiffies < timeout);
-	cn &= ~((EE_CS | EE_SK | EE_DI | EE_DOE) & dev->cntrl_eemask);
-						/* CS=0, SK=0, DI=0, DOE=0 */
-	cntrl_write(dev, cn);
-	udelay(2);
-	return retval;
+		cntrl_read(dev);
+		ns = (u32)ktime_to_ns(ktime_sub(ktime_get(), t0));
+		if (ns < wr_ns) {
+			wr_ns = ns;
+		}
+	}
+	dev->bus_read_ns = rd_ns / CALIBRATE_LOOPS;
+	wr_ns -= min(wr_ns, dev->bus_read_ns);
+	dev->bus_write_ns = wr_ns / CALIBRATE_LOOPS;
+	plxdev_info(dev, "CNTRL read %u ns, write %u ns\n",
+		    dev->bus_read_ns, dev->bus_write_ns);
+#endif
 }
 
-static int
-eeprom_cmd_read_word(struct plx905x_dev *dev, unsigned int offset, u16 *data)
+/* Subtract b from a, limiting the result to 0. */
+static inline unsigned int
+delay_sub(unsigned int a, unsigned int b)
 {
-	u32 cntrl;
-	u16 d;
-	int i;
-	int retval = 0;
+	return a > b ? a - b : 0;
+}
 
-	if (offset >= (dev->eeprom_size >> 1)) {
-		return -ENXIO;
+/*
+ * Work out the delays following each CNTRL register access from the
+ * timing parameters.  If enabled, the time spent writing CNTRL is
+ * subtracted from the delay after each write, and the time taken for a
+ * read to reach the device is subtracted from the delay before DO is
+ * sampled.
+ */
+static void
+eeprom_update_delays(struct plx905x_dev *dev)
+{
+	const struct plx905x_timing *t = &dev->timing;
+	struct plx905x_delays *d = &dev->delay;
+	unsigned int wr_ns = 0;
+	unsigned int rd_ns = 0;
+	unsigned int do_valid;
+
+	if (calibrate) {
+		wr_ns = dev->bus_write_ns;
+		rd_ns = dev->bus_read_ns;
 	}
-	eeprom_start_cmd(dev, &cntrl);
-	eeprom_put_bits(dev, &cntrl, 0x2, 2);
-	eeprom_put_bits(dev, &cntrl, offset, dev->eeprom_addr_len);
-	udelay(1);
-	/* Check dummy bit DO==0. */
-	cntrl = cntrl_read(dev);
-	if ((cntrl & EE_DO) != 0) {
-		retval = -EIO;
-		goto out;
+	d->sk_low = delay_sub(t->sk_low, wr_ns);
+	d->sk_high = delay_sub(t->sk_high, wr_ns);
+	d->cs_low = delay_sub(t->cs_low, wr_ns);
+	/* DO is sampled when the read reaches the device (half way). */
+	do_valid = delay_sub(t->do_valid, wr_ns + rd_ns / 2);
+	d->dummy = delay_sub(do_valid, d->sk_high);
+	/* SK stays high until the read completes and SK=0 is written. */
+	d->sample = max(delay_sub(t->sk_high, wr_ns + rd_ns), do_valid);
+}
+
+/*
+ * Wait after a CNTRL access.  Short delays spin, as a timer would cost
+ * more than the delay itself, but long ones (slow clocks and retries)
+ * sleep on an hrtimer so that the CPU is free between edges.  The
+ * Microwire bus is static, so sleeping longer than asked is harmless.
+ */
+static inline void
+eeprom_delay(unsigned int ns)
+{
+	if (ns >= EEPROM_SLEEP_MIN_NS) {
+		usleep_range(ns / 1000, ns / 500);
+	} else {
+		ndelay(ns);
 	}
-	cntrl |= ((EE_DI | EE_DOE) & dev->cntrl_eemask);	/* DI=1, DOE=1 */
-	/* Read 16 data bits m.s.b. first. */
-	d = 0;
-	for (i = 0; i < 16; i++) {
-		d <<= 1;
-		cntrl &= ~EE_SK;		/* SK=0 */
-		cntrl_write(dev, cntrl);
-		udelay(2);
-		cntrl |= EE_SK;			/* SK=1 */
-		cntrl_write(dev, cntrl);
-		udelay(3);
-		cntrl = cntrl_read(dev);
-		if ((cntrl & EE_DO) != 0) {
-			d |= 1;
-		}
-	}
-	*data = d;
-out:
-	eeprom_end_cmd(dev, &cntrl);
+}
 
-	return retval;
+/*
+ * The bit-bang engine below is generated in a variant for each BAR type,
+ * with the 'pio' parameter a compile-time constant.
+ *
+ * Commands are not clocked out bit by bit.  Instead, the CNTRL states of
+ * each command are precomputed as a waveform, which is then replayed with
+ * a tight write and delay loop.  Waveforms only depend on the command, so
+ * they can be built without holding the mutex.
+ */
+static inline void
+wave_step(struct plx905x_wave *w, u8 step)
+{
+	w->step[w->len++] = step;
 }
 
-static int
-eeprom_cmd_write_word(struct plx905x_dev *dev, unsigned int offset, u16 data)
+/* Append a few bits, clocked out with CS asserted. */
+static __always_inline void
+__wave_put_bits(struct plx905x_wave *w, unsigned int bits,
+		unsigned int nbits)
 {
-	u32 cntrl;
+	u8 di;
 
-	if (offset >= (dev->eeprom_size >> 1)) {
-		return -ENXIO;
+	while (nbits--) {
+		di = ((bits >> nbits) & 1) ? WAVE_DI : 0;
+		wave_step(w, WAVE_CS | di | WAVE_DLY_SK_LOW);
+		wave_step(w, WAVE_CS | di | WAVE_SK | WAVE_DLY_SK_HIGH);
 	}
-	eeprom_start_cmd(dev, &cntrl);
-	eeprom_put_bits(dev, &cntrl, 0x1, 2);
-	eeprom_put_bits(dev, &cntrl, offset, dev->eeprom_addr_len);
-	eeprom_put_bits(dev, &cntrl, data, 16);
-	eeprom_end_cmd(dev, &cntrl);
-	return eeprom_wait_prog(dev);
 }
 
-static int
-eeprom_cmd_write_enable(struct plx905x_dev *dev)
+static void
+wave_put_bits(struct plx905x_wave *w, unsigned int bits, unsigned int nbits)
 {
-	u32 cntrl;
-
-	eeprom_start_cmd(dev, &cntrl);
-	eeprom_put_bits(dev, &cntrl, 0x3, 4);
-	eeprom_put_bits(dev, &cntrl, 0, dev->eeprom_addr_len - 2);
-	eeprom_end_cmd(dev, &cntrl);
-	return 0;
+	__wave_put_bits(w, bits, nbits);
 }
 
-static int
-eeprom_cmd_write_disable(struct plx905x_dev *dev)
+/* Append CS deassertion. */
+static inline void
+wave_end(struct plx905x_wave *w)
 {
-	u32 cntrl;
-
-	eeprom_start_cmd(dev, &cntrl);
-	eeprom_put_bits(dev, &cntrl, 0, dev->eeprom_addr_len + 2);
-	eeprom_end_cmd(dev, &cntrl);
-	return 0;
+	wave_step(w, WAVE_DLY_CS_LOW);		/* CS=0, SK=0, DI=0 */
 }
 
+/* Start a waveform with the start bit, a 2-bit opcode and an address. */
 static void
-eeprom_init(struct plx905x_dev *dev)
+eeprom_wave_cmd(struct plx905x_dev *dev, struct plx905x_wave *w,
+		unsigned int op, unsigned int addr)
 {
-	u32 cn;
+	const unsigned int alen = dev->eeprom_addr_len;
 
-	cn = cntrl_read(dev);
-	eeprom_end_cmd(dev, &cn);
-	cn |= EE_SK;
-	cntrl_write(dev, cn);
-	udelay(2);
-	eeprom_end_cmd(dev, &cn);
+	w->len = 0;
+	__wave_put_bits(w, ((0x4 | op) << alen) | addr, 3 + alen);
 }
 
-static int
-plx905x_open(struct inode *inode, struct file *filp)
+/*
+ * Replay a waveform.  The CNTRL value of each step is looked up from its
+ * line states, so there are no bit-level decisions in the loop.
+ */
+static __always_inline void
+__eeprom_replay(struct plx905x_dev *dev, const struct plx905x_wave *w,
+		const int pio)
 {
-	struct plx905x_dev *dev = &plx905x_device;
+	const u32 base = cntrl_get(dev) &
+		~((EE_CS | EE_SK | EE_DI | EE_DOE) & dev->cntrl_eemask);
+	unsigned int delay[3];
+	unsigned int i;
+	u8 step;
 
-	filp->private_data = dev;
-	mutex_lock(&dev->mutex);
-	eeprom_init(dev);
-	mutex_unlock(&dev->mutex);
-	return 0;
+	delay[WAVE_DLY_SK_LOW >> WAVE_DLY_SHIFT] = dev->delay.sk_low;
+	delay[WAVE_DLY_SK_HIGH >> WAVE_DLY_SHIFT] = dev->delay.sk_high;
+	delay[WAVE_DLY_CS_LOW >> WAVE_DLY_SHIFT] = dev->delay.cs_low;
+	for (i = 0; i < w->len; i++) {
+		step = w->step[i];
+		__cntrl_write(dev, base | dev->wave_lines[step & WAVE_LINES],
+			      pio);
+		eeprom_delay(delay[step >> WAVE_DLY_SHIFT]);
+	}
 }
 
-static int
-plx905x_release(struct inode *inode, struct file *filp)
+/* Deassert CS.  Assumes *cntrl is valid. */
+static __always_inline void
+__eeprom_end_cmd(struct plx905x_dev *dev, u32 *cntrl, const int pio)
 {
-	return 0;
+	u32 cn = *cntrl;
+
+	cn &= ~((EE_CS | EE_SK | EE_DI | EE_DOE) & dev->cntrl_eemask);
+						/* CS=0, SK=0, DI=0, DOE=0 */
+	__cntrl_write(dev, cn, pio);
+	eeprom_delay(dev->delay.cs_low);
+	*cntrl = cn;
 }
 
-static ssize_t
-plx905x_read(struct file *filp, char *buf, size_t count, loff_t *f_pos)
+/*
+ * Check the dummy bit following the address of a READ command and read
+ * 16-bit words.  Sets *cntrl to the last value written.
+ */
+static __always_inline int
+__eeprom_get_words(struct plx905x_dev *dev, u32 *cntrl, u16 *data,
+		   unsigned int nwords, const int pio)
 {
-	struct plx905x_dev *dev = filp->private_data;
-	ssize_t retval = 0;
-	size_t n = 0;
-	unsigned int addr;
+	u32 cn;
+	u16 d;
+	int i;
+
+	eeprom_delay(dev->delay.dummy);
+	/* Check dummy bit DO==0. */
+	cn = __cntrl_read(dev, pio);
+	*cntrl = cn;
+	if ((cn & EE_DO) != 0) {
+		return -EIO;
+	}
+	cn |= ((EE_DI | EE_DOE) & dev->cntrl_eemask);
+							/* DI=1, DOE=1 */
+	cn &= ~EE_SK;
+	while (nwords--) {
+		/* Read 16 data bits m.s.b. first. */
+		d = 0;
+		for (i = 0; i < 16; i++) {
+			d <<= 1;
+			__cntrl_write(dev, cn, pio);		/* SK=0 */
+			eeprom_delay(dev->delay.sk_low);
+			__cntrl_write(dev, cn | EE_SK, pio);	/* SK=1 */
+			eeprom_delay(dev->delay.sample);
+			if ((__cntrl_read(dev, pio) & EE_DO) != 0) {
+				d |= 1;
+			}
+		}
+		*data++ = d;
+	}
+	*cntrl = dev->cntrl_shadow;
+	return 0;
+}
+
+/*
+ * Bit-bang engine operations, bound to the device at probe time according
+ * to the BAR type.
+ */
+struct plx905x_bitops {
+	void (*replay)(struct plx905x_dev *dev, const struct plx905x_wave *w);
+	void (*end_cmd)(struct plx905x_dev *dev, u32 *cntrl);
+	int (*get_words)(struct plx905x_dev *dev, u32 *cntrl, u16 *data,
+			 unsigned int nwords);
+};
+
+#define PLX905X_DEFINE_BITOPS(_name, _pio)				\
+static void								\
+_name##_replay(struct plx905x_dev *dev, const struct plx905x_wave *w)	\
+{									\
+	__eeprom_replay(dev, w, _pio);					\
+}									\
+static void								\
+_name##_end_cmd(struct plx905x_dev *dev, u32 *cntrl)			\
+{									\
+	__eeprom_end_cmd(dev, cntrl, _pio);				\
+}									\
+static int								\
+_name##_get_words(struct plx905x_dev *dev, u32 *cntrl, u16 *data,	\
+		  unsigned int nwords)					\
+{									\
+	return __eeprom_get_words(dev, cntrl, data, nwords, _pio);	\
+}									\
+static const struct plx905x_bitops _name##_bitops = {			\
+	.replay = _name##_replay,					\
+	.end_cmd = _name##_end_cmd,					\
+	.get_words = _name##_get_words,					\
+}
+
+PLX905X_DEFINE_BITOPS(pio, 1);
+PLX905X_DEFINE_BITOPS(mmio, 0);
+
+/*
+ * Start a waveform with one of the commands with opcode 00 (EWEN, ERAL,
+ * WRAL, EWDS), which are selected by the two most significant address
+ * bits.
+ */
+static void
+eeprom_wave_ext_cmd(struct plx905x_dev *dev, struct plx905x_wave *w,
+		    unsigned int ext)
+{
+	eeprom_wave_cmd(dev, w, 0, ext << (dev->eeprom_addr_len - 2));
+}
+
+/*
+ * Bind the bit-bang engine variant matching the device, and precompute
+ * the CNTRL line states and fixed waveforms.  Must be called again if the
+ * EEPROM address length changes.
+ */
+static void
+plx905x_select_bitops(struct plx905x_dev *dev)
+{
+	unsigned int pio = (dev->iospace == IORESOURCE_IO);
+	unsigned int i;
+	u32 lines;
+
+	dev->bitops = pio ? &pio_bitops : &mmio_bitops;
+
+	for (i = 0; i <= WAVE_LINES; i++) {
+		lines = 0;
+		if (i & WAVE_SK) {
+			lines |= EE_SK;
+		}
+		if (i & WAVE_DI) {
+			lines |= EE_DI | EE_DOE;
+		}
+		if (i & WAVE_CS) {
+			lines |= EE_CS;
+		}
+		dev->wave_lines[i] = lines & dev->cntrl_eemask;
+	}
+
+	eeprom_wave_ext_cmd(dev, &dev->wave_ewen, 0x3);
+	wave_end(&dev->wave_ewen);
+	eeprom_wave_ext_cmd(dev, &dev->wave_ewds, 0x0);
+	wave_end(&dev->wave_ewds);
+}
+
+static inline void
+eeprom_replay(struct plx905x_dev *dev, const struct plx905x_wave *w)
+{
+	dev->bitops->replay(dev, w);
+}
+
+static inline void
+eeprom_end_cmd(struct plx905x_dev *dev, u32 *cntrl)
+{
+	dev->bitops->end_cmd(dev, cntrl);
+}
+
+/* Build the waveform of a WRITE command. */
+static void
+eeprom_wave_write(struct plx905x_dev *dev, struct plx905x_wave *w,
+		  unsigned int offset, u16 data)
+{
+	eeprom_wave_cmd(dev, w, 0x1, offset);
+	wave_put_bits(w, data, 16);
+	wave_end(w);
+}
+
+static void
+eeprom_init(struct plx905x_dev *dev)
+{
+	u32 cn;
+
+	cn = cntrl_read(dev);
+	clear_bit(PLX905X_STATUS_CNTRL_STALE, &dev->status);
+	eeprom_end_cmd(dev, &cn);
+	cn |= EE_SK;
+	cntrl_write(dev, cn);
+	eeprom_delay(dev->delay.sk_high);
+	eeprom_end_cmd(dev, &cn);
+}
+
+/*
+ * Slow down the EEPROM clock for retry number 'attempt' (from 1) after an
+ * I/O error, using at least the "safe" timing profile, doubled for each
+ * further attempt, and resynchronize the EEPROM.  'saved' is the timing to
+ * be restored by eeprom_retry_end().
+ */
+static void
+eeprom_retry_timing(struct plx905x_dev *dev,
+		    const struct plx905x_timing *saved, unsigned int attempt)
+{
+	const struct plx905x_timing *safe = &plx905x_timing_profiles[0].timing;
+	const unsigned int shift = attempt - 1;
+
+	dev->timing.sk_low = min(max(saved->sk_low, safe->sk_low) << shift,
+				 (unsigned int)EEPROM_MAX_DELAY_NS);
+	dev->timing.sk_high = min(max(saved->sk_high, safe->sk_high) << shift,
+				  (unsigned int)EEPROM_MAX_DELAY_NS);
+	dev->timing.cs_low = min(max(saved->cs_low, safe->cs_low) << shift,
+				 (unsigned int)EEPROM_MAX_DELAY_NS);
+	dev->timing.do_valid = min(max(saved->do_valid, safe->do_valid) << shift,
+				   (unsigned int)EEPROM_MAX_DELAY_NS);
+	eeprom_update_delays(dev);
+	eeprom_init(dev);
+	dev->io_retries++;
+}
+
+/* Restore the timing after retries and record the outcome. */
+static void
+eeprom_retry_end(struct plx905x_dev *dev, const struct plx905x_timing *saved,
+		 unsigned int attempts, int retval)
+{
+	dev->timing = *saved;
+	eeprom_update_delays(dev);
+	if (retval) {
+		dev->io_errors++;
+	}
+	csdev_dbglvl(1, dev->csdev, "%s after %u slow-clock retries\n",
+		     retval ? "failed" : "succeeded", attempts);
+}
+
+/*
+ * Wait for programming cycle to complete.  Sleeps for the predicted
+ * programming time, then polls for the ready status with increasing
+ * intervals.  The prediction is adjusted from each observed programming
+ * time: shortened a little if the cycle had already completed by the
+ * first poll, otherwise moved towards the observed time.
+ */
+static int
+eeprom_wait_prog(struct plx905x_dev *dev)
+{
+	unsigned long old_jiffies;
+	unsigned long timeout;
+#ifdef KCOMPAT_HAVE_KTIME
+	ktime_t start;
+#endif
+	unsigned int elapsed_us;
+	unsigned int poll_us;
+	unsigned int polls = 0;
+	u32 cn;
+	int retval;
+
+	timeout = 1 + (((EEPROM_TWP_TIMEOUT_MS * HZ) + 999) / 1000);
+	cn = cntrl_get(dev);
+	cn = (cn & ~EE_SK) | ((EE_CS | EE_DI | EE_DOE) & dev->cntrl_eemask);
+						/* SK=0, CS=1, DI=1, DOE=1 */
+	cntrl_write(dev, cn);
+	old_jiffies = jiffies;
+#ifdef KCOMPAT_HAVE_KTIME
+	start = ktime_get();
+#endif
+	retval = -EIO;
+	usleep_range(dev->twp_us, dev->twp_us + dev->twp_us / 8);
+	poll_us = EEPROM_TWP_POLL_US;
+	for (;;) {
+		cn = cntrl_read(dev);
+		if ((cn & EE_DO) != 0) {
+			/* Cycle complete.  Clear ready status (optional). */
+			cn |= EE_SK;		/* SK=1 */
+			cntrl_write(dev, cn);
+			eeprom_delay(dev->delay.sk_high);
+			retval = 0;
+			break;
+		}
+		if (jiffies - old_jiffies >= timeout) {
+			break;
+		}
+		polls++;
+		usleep_range(poll_us, poll_us * 2);
+		if (poll_us < EEPROM_TWP_POLL_MAX_US) {
+			poll_us *= 2;
+		}
+	}
+	cn &= ~((EE_CS | EE_SK | EE_DI | EE_DOE) & dev->cntrl_eemask);
+						/* CS=0, SK=0, DI=0, DOE=0 */
+	cntrl_write(dev, cn);
+	eeprom_delay(dev->delay.cs_low);
+	if (retval) {
+		return retval;
+	}
+
+#ifdef KCOMPAT_HAVE_KTIME
+	elapsed_us = (u32)ktime_to_ns(ktime_sub(ktime_get(), start)) / 1000;
+#else
+	elapsed_us = jiffies_to_msecs(jiffies - old_jiffies) * 1000;
+#endif
+	if (polls == 0) {
+		dev->twp_us -= dev->twp_us / 16;
+		if (dev->twp_us < EEPROM_TWP_MIN_US) {
+			dev->twp_us = EEPROM_TWP_MIN_US;
+		}
+	} else if (elapsed_us > dev->twp_us) {
+		dev->twp_us += (elapsed_us - dev->twp_us) / 4;
+	}
+	csdev_dbglvl(2, dev->csdev,
+		     "programmed in %u us (%u polls), tWP now %u us\n",
+		     elapsed_us, polls, dev->twp_us);
+	return 0;
+}
+
+/*
+ * Read a range of 16-bit words with a single sequential READ command.
+ * With CS held, the 93Cx6 keeps shifting out the next word after each
+ * 16 data bits, so the start bit, opcode and address are only sent once.
+ */
+static int
+eeprom_cmd_read_words(struct plx905x_dev *dev, unsigned int offset,
+		      u16 *data, unsigned int nwords)
+{
+	struct plx905x_wave w;
+	u32 cntrl;
+	int retval;
+
+	if (offset >= (dev->eeprom_size >> 1) ||
+	    nwords > (dev->eeprom_size >> 1) - offset) {
+		return -ENXIO;
+	}
+	if (nwords == 0) {
+		return 0;
+	}
+	eeprom_wave_cmd(dev, &w, 0x2, offset);
+	eeprom_replay(dev, &w);
+	retval = dev->bitops->get_words(dev, &cntrl, data, nwords);
+	eeprom_end_cmd(dev, &cntrl);
+
+	return retval;
+}
+
+static int
+eeprom_cmd_read_word(struct plx905x_dev *dev, unsigned int offset, u16 *data)
+{
+	return eeprom_cmd_read_words(dev, offset, data, 1);
+}
+
+/*
+ * Read back a word after programming it.  A mismatch is reported as -EIO,
+ * like a missing completion signal.
+ */
+static int
+eeprom_cmd_verify_word(struct plx905x_dev *dev, unsigned int offset,
+		       u16 data)
+{
+	u16 check;
+	int retval;
+
+	retval = eeprom_cmd_read_word(dev, offset, &check);
+	if (!retval && check != data) {
+		retval = -EIO;
+	}
+	return retval;
+}
+
+/*
+ * Write a 16-bit word, using a prebuilt waveform of the WRITE command if
+ * 'w' is not NULL, and read it back.  If the EEPROM does not signal
+ * completion or the word reads back wrong, the command is retried with a
+ * slower clock.
+ */
+static int
+eeprom_cmd_write_word(struct plx905x_dev *dev, unsigned int offset, u16 data,
+		      const struct plx905x_wave *w)
+{
+	struct plx905x_wave wave;
+	struct plx905x_timing saved;
+	unsigned int attempt;
+	int retval;
+
+	if (offset >= (dev->eeprom_size >> 1)) {
+		return -ENXIO;
+	}
+	if (!w) {
+		eeprom_wave_write(dev, &wave, offset, data);
+		w = &wave;
+	}
+	eeprom_replay(dev, w);
+	retval = eeprom_wait_prog(dev);
+	if (!retval) {
+		retval = eeprom_cmd_verify_word(dev, offset, data);
+	}
+	if (retval != -EIO || !retries) {
+		return retval;
+	}
+	saved = dev->timing;
+	for (attempt = 1; attempt <= retries && retval == -EIO; attempt++) {
+		eeprom_retry_timing(dev, &saved, attempt);
+		eeprom_replay(dev, w);
+		retval = eeprom_wait_prog(dev);
+		if (!retval) {
+			retval = eeprom_cmd_verify_word(dev, offset, data);
+		}
+	}
+	eeprom_retry_end(dev, &saved, attempt - 1, retval);
+	return retval;
+}
+
+static int
+eeprom_cmd_write_enable(struct plx905x_dev *dev)
+{
+	eeprom_replay(dev, &dev->wave_ewen);
+	return 0;
+}
+
+static int
+eeprom_cmd_write_disable(struct plx905x_dev *dev)
+{
+	eeprom_replay(dev, &dev->wave_ewds);
+	return 0;
+}
+
+/*
+ * Wait for the VPD address register flag to reach the specified value,
+ * indicating completion of a VPD read (flag set) or write (flag clear).
+ */
+static int
+vpd_wait(struct plx905x_dev *dev, u16 flag)
+{
+	unsigned long old_jiffies;
+	unsigned long timeout;
+	unsigned int polls;
+	u16 addr;
+
+	timeout = 1 + (((VPD_TIMEOUT_MS * HZ) + 999) / 1000);
+	old_jiffies = jiffies;
+	for (polls = 0; ; polls++) {
+		pci_read_config_word(dev->pcidev, dev->vpd_cap + PCI_VPD_ADDR,
+				     &addr);
+		if ((addr & PCI_VPD_ADDR_F) == flag) {
+			return 0;
+		}
+		if (jiffies - old_jiffies >= timeout) {
+			return -EIO;
+		}
+		if (polls < VPD_SPIN_POLLS) {
+			udelay(VPD_SPIN_US);
+		} else {
+			usleep_range(VPD_POLL_US, VPD_POLL_US * 2);
+		}
+	}
+}
+
+static int
+vpd_read_dword(struct plx905x_dev *dev, unsigned int offset, u32 *data)
+{
+	int retval;
+
+	pci_write_config_word(dev->pcidev, dev->vpd_cap + PCI_VPD_ADDR,
+			      (offset << 2) & PCI_VPD_ADDR_MASK);
+	retval = vpd_wait(dev, PCI_VPD_ADDR_F);
+	if (retval) {
+		return retval;
+	}
+	pci_read_config_dword(dev->pcidev, dev->vpd_cap + PCI_VPD_DATA, data);
+	return 0;
+}
+
+static int
+vpd_write_dword(struct plx905x_dev *dev, unsigned int offset, u32 data)
+{
+	pci_write_config_dword(dev->pcidev, dev->vpd_cap + PCI_VPD_DATA, data);
+	pci_write_config_word(dev->pcidev, dev->vpd_cap + PCI_VPD_ADDR,
+			      ((offset << 2) & PCI_VPD_ADDR_MASK) |
+			      PCI_VPD_ADDR_F);
+	return vpd_wait(dev, 0);
+}
+
+/* Get the 16-bit word at index (0 or 1) of a VPD dword. */
+static inline u16
+vpd_dword_word(struct plx905x_dev *dev, u32 dword, unsigned int index)
+{
+	return (index ^ dev->vpd_swap) ? (dword >> 16) : dword;
+}
+
+/* Replace the 16-bit word at index (0 or 1) of a VPD dword. */
+static inline u32
+vpd_dword_set_word(struct plx905x_dev *dev, u32 dword, unsigned int index,
+		   u16 data)
+{
+	if (index ^ dev->vpd_swap) {
+		return (dword & 0x0000FFFF) | ((u32)data << 16);
+	} else {
+		return (dword & 0xFFFF0000) | data;
+	}
+}
+
+static int
+vpd_read_words(struct plx905x_dev *dev, unsigned int offset, u16 *data,
+	       unsigned int nwords)
+{
+	u32 dword;
+	int retval;
+
+	if (offset >= (dev->eeprom_size >> 1) ||
+	    nwords > (dev->eeprom_size >> 1) - offset) {
+		return -ENXIO;
+	}
+	while (nwords) {
+		retval = vpd_read_dword(dev, offset >> 1, &dword);
+		if (retval) {
+			return retval;
+		}
+		do {
+			*data++ = vpd_dword_word(dev, dword, offset & 1);
+			offset++;
+			nwords--;
+		} while (nwords && (offset & 1));
+	}
+	return 0;
+}
+
+/*
+ * Write a 16-bit word through VPD.  VPD writes to the chip's write-protected
+ * area of the EEPROM are silently ignored, so the dword is read back and the
+ * word is programmed by bit-banging if it did not change.
+ */
+static int
+vpd_write_word(struct plx905x_dev *dev, unsigned int offset, u16 data)
+{
+	u32 old;
+	u32 new;
+	int retval;
+
+	if (offset >= (dev->eeprom_size >> 1)) {
+		return -ENXIO;
+	}
+	retval = vpd_read_dword(dev, offset >> 1, &old);
+	if (retval) {
+		return retval;
+	}
+	new = vpd_dword_set_word(dev, old, offset & 1, data);
+	if (new == old) {
+		return 0;
+	}
+	retval = vpd_write_dword(dev, offset >> 1, new);
+	if (!retval) {
+		retval = vpd_read_dword(dev, offset >> 1, &old);
+	}
+	if (retval || old == new) {
+		return retval;
+	}
+	csdev_dbg(dev->csdev, "VPD write of word 0x%x ignored\n", offset);
+	eeprom_cmd_write_enable(dev);
+	return eeprom_cmd_write_word(dev, offset, data, NULL);
+}
+
+/*
+ * Read a range of 16-bit words using the selected access engine.
+ */
+static int
+eeprom_engine_read_words(struct plx905x_dev *dev, unsigned int offset,
+			 u16 *data, unsigned int nwords)
+{
+	struct plx905x_timing saved;
+	unsigned int attempt;
+	int retval;
+
+	if (dev->engine == PLX905X_ENGINE_VPD) {
+		return vpd_read_words(dev, offset, data, nwords);
+	}
+	retval = eeprom_cmd_read_words(dev, offset, data, nwords);
+	if (retval != -EIO || !retries) {
+		return retval;
+	}
+	/* Dummy bit was wrong; try again with a slower clock. */
+	saved = dev->timing;
+	for (attempt = 1; attempt <= retries && retval == -EIO; attempt++) {
+		eeprom_retry_timing(dev, &saved, attempt);
+		retval = eeprom_cmd_read_words(dev, offset, data, nwords);
+	}
+	eeprom_retry_end(dev, &saved, attempt - 1, retval);
+	return retval;
+}
+
+/*
+ * Discard the RAM copy of the EEPROM contents.
+ */
+static void
+eeprom_cache_invalidate(struct plx905x_dev *dev)
+{
+	dev->write_gen++;
+	clear_bit(PLX905X_STATUS_CACHE_VALID, &dev->status);
+	memset(dev->cache_filled, 0, sizeof(dev->cache_filled));
+}
+
+/*
+ * Check whether a word of the RAM copy of the EEPROM contents is valid.
+ */
+static int
+eeprom_cache_word_valid(struct plx905x_dev *dev, unsigned int offset)
+{
+	return test_bit(PLX905X_STATUS_CACHE_VALID, &dev->status) ||
+		test_bit(offset, dev->cache_filled);
+}
+
+/*
+ * Fill the words of the RAM copy of the EEPROM contents in a range that
+ * are not valid yet, reading each run of missing words with a single
+ * command.  The RAM copy becomes valid as a whole once every word has
+ * been filled.
+ */
+static int
+eeprom_cache_fill(struct plx905x_dev *dev, unsigned int offset,
+		  unsigned int nwords)
+{
+	unsigned int end = offset + nwords;
+	unsigned int run;
+	unsigned int i;
+	int retval;
+
+	while (offset < end) {
+		if (eeprom_cache_word_valid(dev, offset)) {
+			offset++;
+			continue;
+		}
+		for (run = 1; offset + run < end; run++) {
+			if (eeprom_cache_word_valid(dev, offset + run)) {
+				break;
+			}
+		}
+		retval = eeprom_engine_read_words(dev, offset,
+						  &dev->cache[offset], run);
+		if (retval) {
+			return retval;
+		}
+		for (; run; run--, offset++) {
+			set_bit(offset, dev->cache_filled);
+		}
+	}
+	for (i = 0; i < (dev->eeprom_size >> 1); i++) {
+		if (!test_bit(i, dev->cache_filled)) {
+			return 0;
+		}
+	}
+	set_bit(PLX905X_STATUS_CACHE_VALID, &dev->status);
+	return 0;
+}
+
+/*
+ * Read a range of 16-bit words, using the RAM copy of the EEPROM if
+ * enabled.  Words missing from the RAM copy are filled from the EEPROM.
+ */
+static int
+eeprom_read_words(struct plx905x_dev *dev, unsigned int offset, u16 *data,
+		  unsigned int nwords)
+{
+	int retval;
+
+	if (!dev->use_cache) {
+		return eeprom_engine_read_words(dev, offset, data, nwords);
+	}
+	if (offset >= (dev->eeprom_size >> 1) ||
+	    nwords > (dev->eeprom_size >> 1) - offset) {
+		return -ENXIO;
+	}
+	if (!test_bit(PLX905X_STATUS_CACHE_VALID, &dev->status)) {
+		retval = eeprom_cache_fill(dev, offset, nwords);
+		if (retval) {
+			return retval;
+		}
+	}
+	memcpy(data, &dev->cache[offset], nwords * sizeof(u16));
+	return 0;
+}
+
+/*
+ * Write a 16-bit word, keeping the RAM copy of the EEPROM coherent.  If
+ * the write fails, the contents of the word are unknown, so the word is
+ * dropped from the RAM copy.  'w' is a prebuilt waveform of the WRITE
+ * command for the bit-bang engine, or NULL.
+ */
+static int
+eeprom_write_word(struct plx905x_dev *dev, unsigned int offset, u16 data,
+		  const struct plx905x_wave *w)
+{
+	int retval;
+
+	dev->write_gen++;
+	if (dev->engine == PLX905X_ENGINE_VPD) {
+		retval = vpd_write_word(dev, offset, data);
+	} else {
+		retval = eeprom_cmd_write_word(dev, offset, data, w);
+	}
+	if (retval) {
+		clear_bit(PLX905X_STATUS_CACHE_VALID, &dev->status);
+		clear_bit(offset, dev->cache_filled);
+	} else if (eeprom_cache_word_valid(dev, offset)) {
+		dev->cache[offset] = data;
+	}
+	return retval;
+}
+
+static int
+eeprom_cmd_erase_all(struct plx905x_dev *dev)
+{
+	struct plx905x_wave w;
+
+	eeprom_wave_ext_cmd(dev, &w, 0x2);
+	wave_end(&w);
+	eeprom_replay(dev, &w);
+	return eeprom_wait_prog(dev);
+}
+
+static int
+eeprom_cmd_write_all(struct plx905x_dev *dev, u16 data)
+{
+	struct plx905x_wave w;
+
+	eeprom_wave_ext_cmd(dev, &w, 0x1);
+	wave_put_bits(&w, data, 16);
+	wave_end(&w);
+	eeprom_replay(dev, &w);
+	return eeprom_wait_prog(dev);
+}
+
+/*
+ * Fill the whole EEPROM with a 16-bit pattern in a single programming
+ * cycle, keeping the RAM copy of the EEPROM coherent.  ERAL is used for
+ * the erased state (all ones) and WRAL otherwise.  The EEPROM must be
+ * write-enabled.  The EEPROM is read back afterwards.
+ */
+static int
+eeprom_fill(struct plx905x_dev *dev, u16 data)
+{
+	unsigned int twp_us = dev->twp_us;
+	unsigned int nwords = dev->eeprom_size >> 1;
+	u16 check[EEPROM_SEQ_READ_WORDS];
+	unsigned int i;
+	unsigned int j;
+	unsigned int n;
+	int retval;
+
+	dev->write_gen++;
+	if (data == 0xFFFF) {
+		retval = eeprom_cmd_erase_all(dev);
+	} else {
+		retval = eeprom_cmd_write_all(dev, data);
+	}
+	/* Bulk cycles are slower, so do not learn from them. */
+	dev->twp_us = twp_us;
+	for (i = 0; i < nwords && !retval; i += n) {
+		n = min_t(unsigned int, nwords - i, EEPROM_SEQ_READ_WORDS);
+		retval = eeprom_cmd_read_words(dev, i, check, n);
+		for (j = 0; j < n && !retval; j++) {
+			if (check[j] != data) {
+				retval = -EIO;
+			}
+		}
+	}
+	if (retval) {
+		eeprom_cache_invalidate(dev);
+	} else {
+		for (i = 0; i < (dev->eeprom_size >> 1); i++) {
+			dev->cache[i] = data;
+		}
+		set_bit(PLX905X_STATUS_CACHE_VALID, &dev->status);
+	}
+	return retval;
+}
+
+/*
+ * Write-enable the EEPROM unless it is still write-enabled.
+ */
+static int
+eeprom_write_begin(struct plx905x_dev *dev)
+{
+	int retval = 0;
+
+	if (!test_bit(PLX905X_STATUS_WRITE_ENABLED, &dev->status)) {
+		retval = eeprom_cmd_write_enable(dev);
+		if (!retval) {
+			set_bit(PLX905X_STATUS_WRITE_ENABLED, &dev->status);
+		}
+	}
+	return retval;
+}
+
+/*
+ * Write-disable the EEPROM unless a write session is holding it enabled.
+ */
+static int
+eeprom_write_end(struct plx905x_dev *dev)
+{
+	if (dev->write_sessions ||
+	    !test_and_clear_bit(PLX905X_STATUS_WRITE_ENABLED, &dev->status)) {
+		return 0;
+	}
+	return eeprom_cmd_write_disable(dev);
+}
+
+/*
+ * Make the PLX chip reload its configuration registers from the EEPROM by
+ * pulsing the reload bit in the CNTRL register.  The PCI configuration
+ * header is saved and restored around the reload so that the BARs and
+ * command register remain as set up by the kernel.  The caller holds the
+ * mutex.
+ */
+static void
+plx905x_reload_config(struct plx905x_dev *dev)
+{
+	u32 cn;
+
+#ifdef KCOMPAT_PCI_SAVE_STATE_HAS_BUFFER
+	pci_save_state(dev->pcidev, dev->saved_config);
+#else
+	pci_save_state(dev->pcidev);
+#endif
+	cn = cntrl_get(dev) & ~EE_RELOAD;
+	cntrl_write(dev, cn);
+	cntrl_write(dev, cn | EE_RELOAD);
+	msleep(PLX905X_RELOAD_MS);
+	/* CNTRL itself may have been reloaded. */
+	cn = cntrl_read(dev);
+	if (cn & EE_RELOAD) {
+		cntrl_write(dev, cn & ~EE_RELOAD);
+	}
+#ifdef KCOMPAT_PCI_SAVE_STATE_HAS_BUFFER
+	pci_restore_state(dev->pcidev, dev->saved_config);
+#else
+	pci_restore_state(dev->pcidev);
+#endif
+	set_bit(PLX905X_STATUS_CNTRL_STALE, &dev->status);
+	eeprom_init(dev);
+	csdev_dbg(dev->csdev, "configuration reloaded from EEPROM\n");
+}
+
+/*
+ * Count the address bits expected by the EEPROM.  A READ command is sent
+ * one address bit at a time until the EEPROM drives the dummy 0 bit that
+ * precedes the data.  Returns the number of address bits, or 0 if the
+ * dummy bit was not seen.
+ */
+static unsigned int
+eeprom_probe_addr_len(struct plx905x_dev *dev)
+{
+	struct plx905x_wave w;
+	unsigned int n;
+	u32 cn;
+
+	eeprom_init(dev);
+	w.len = 0;
+	wave_put_bits(&w, 0x6, 3);	/* start bit and READ opcode */
+	eeprom_replay(dev, &w);
+	for (n = 1; n <= EEPROM_MAX_ADDR_LEN; n++) {
+		w.len = 0;
+		wave_put_bits(&w, 0, 1);
+		eeprom_replay(dev, &w);
+		eeprom_delay(dev->delay.dummy);
+		if ((cntrl_read(dev) & EE_DO) == 0) {
+			break;
+		}
+	}
+	cn = cntrl_get(dev);
+	eeprom_end_cmd(dev, &cn);
+	eeprom_init(dev);
+	return (n <= EEPROM_MAX_ADDR_LEN) ? n : 0;
+}
+
+/*
+ * Work out the EEPROM size, from 'min_size' to 'max_size' bytes.  The
+ * address length tells a 93C46 from a 93C56 or 93C66.  A 93C56 ignores
+ * the most significant of its 8 address bits, so its contents appear
+ * twice when read as a 93C66.  (An EEPROM whose two halves are identical
+ * is assumed to be a 93C56.)  Returns 0 on success, or -ENODEV if the
+ * size could not be determined.
+ */
+static int
+plx905x_detect_eeprom(struct plx905x_dev *dev, size_t min_size,
+		      size_t max_size)
+{
+	unsigned int addr_len;
+	size_t size;
+	u16 *words;
+	int rc;
+
+	addr_len = eeprom_probe_addr_len(dev);
+	switch (addr_len) {
+	case CS46_EEPROM_ADDR_LEN:
+		size = CS46_EEPROM_SIZE;
+		break;
+	case CS56_EEPROM_ADDR_LEN:
+		size = CS56_EEPROM_SIZE;
+		if (max_size < CS66_EEPROM_SIZE) {
+			break;
+		}
+		words = kmalloc(CS66_EEPROM_SIZE, GFP_KERNEL);
+		if (!words) {
+			return -ENOMEM;
+		}
+		dev->eeprom_size = CS66_EEPROM_SIZE;
+		dev->eeprom_addr_len = CS66_EEPROM_ADDR_LEN;
+		rc = eeprom_cmd_read_words(dev, 0, words,
+					   CS66_EEPROM_SIZE / 2);
+		if (!rc && memcmp(words, words + CS56_EEPROM_SIZE / 2,
+				  CS56_EEPROM_SIZE)) {
+			size = CS66_EEPROM_SIZE;
+		}
+		kfree(words);
+		if (rc) {
+			plxdev_warn(dev, "EEPROM read failed while "
+				    "detecting size\n");
+			return -ENODEV;
+		}
+		break;
+	default:
+		plxdev_warn(dev, "EEPROM address length not detected\n");
+		return -ENODEV;
+	}
+	if (size < min_size || size > max_size) {
+		plxdev_warn(dev, "detected %u-byte EEPROM not supported\n",
+			    (unsigned int)size);
+		return -ENODEV;
+	}
+	dev->eeprom_size = size;
+	dev->eeprom_addr_len = addr_len;
+	plxdev_info(dev, "detected %u-byte EEPROM (%u address bits)\n",
+		    (unsigned int)size, addr_len);
+	return 0;
+}
+
+/*
+ * Set all timing parameters from a single SK half-period.
+ */
+static void
+plx905x_set_clock(struct plx905x_dev *dev, unsigned int ns)
+{
+	dev->timing.sk_low = ns;
+	dev->timing.sk_high = ns;
+	dev->timing.cs_low = ns;
+	dev->timing.do_valid = ns;
+	dev->timing_name = "clock";
+	dev->clock_ns = ns;
+	eeprom_update_delays(dev);
+}
+
+/*
+ * Check that bit-bang reads at the current timing return the reference
+ * data, with a correct dummy bit, several times in a row.
+ */
+static int
+plx905x_train_stable(struct plx905x_dev *dev, const u16 *ref,
+		     unsigned int nwords)
+{
+	u16 data[TRAIN_WORDS];
+	unsigned int pass;
+
+	for (pass = 0; pass < TRAIN_PASSES; pass++) {
+		if (eeprom_cmd_read_words(dev, 0, data, nwords) ||
+		    memcmp(data, ref, nwords * sizeof(*data))) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Find the fastest EEPROM clock whose reads are stable by a binary search
+ * between the slowest time of the "fast" timing profile and the slowest
+ * time of the current timing profile, which must itself be stable.  The
+ * result has a safety margin added.  Reads that go wrong are harmless as
+ * long as the EEPROM is write-disabled.  Writes are always read back (see
+ * eeprom_cmd_write_word()), as only reads are checked here.
+ */
+static void
+plx905x_train_clock(struct plx905x_dev *dev)
+{
+	struct plx905x_timing saved = dev->timing;
+	const char *saved_name = dev->timing_name;
+	const struct plx905x_timing *fast =
+		&plx905x_find_timing_profile("fast")->timing;
+	u16 ref[TRAIN_WORDS];
+	unsigned int nwords = min_t(unsigned int, TRAIN_WORDS,
+				    dev->eeprom_size >> 1);
+	unsigned int lo;
+	unsigned int top;
+	unsigned int hi;
+	unsigned int mid;
+	unsigned int ns;
+
+	top = max(max(saved.sk_low, saved.sk_high),
+		  max(saved.cs_low, saved.do_valid));
+	lo = max(max(fast->sk_low, fast->sk_high),
+		 max(fast->cs_low, fast->do_valid));
+	if (top <= lo) {
+		/* Already as fast as allowed. */
+		return;
+	}
+	hi = top;
+	eeprom_init(dev);
+	eeprom_cmd_write_disable(dev);
+	if (eeprom_cmd_read_words(dev, 0, ref, nwords) ||
+	    !plx905x_train_stable(dev, ref, nwords)) {
+		plxdev_warn(dev, "EEPROM reads unstable with %s timing, "
+			    "not training\n", saved_name);
+		return;
+	}
+	plx905x_set_clock(dev, hi);
+	if (!plx905x_train_stable(dev, ref, nwords)) {
+		goto fail;
+	}
+	plx905x_set_clock(dev, lo);
+	if (plx905x_train_stable(dev, ref, nwords)) {
+		hi = lo;
+	} else {
+		eeprom_init(dev);
+	}
+	while (hi - lo > TRAIN_RES_NS) {
+		mid = lo + (hi - lo) / 2;
+		plx905x_set_clock(dev, mid);
+		if (plx905x_train_stable(dev, ref, nwords)) {
+			hi = mid;
+		} else {
+			lo = mid;
+			eeprom_init(dev);
+		}
+	}
+	ns = hi + max(hi * TRAIN_MARGIN_PCT / 100,
+		      (unsigned int)TRAIN_MARGIN_MIN_NS);
+	plx905x_set_clock(dev, min(ns, top));
+	eeprom_init(dev);
+	if (plx905x_train_stable(dev, ref, nwords)) {
+		plxdev_info(dev, "EEPROM clock trained: half-period %u ns "
+			    "(stable down to %u ns)\n", dev->clock_ns, hi);
+		return;
+	}
+fail:
+	plxdev_warn(dev, "EEPROM clock training failed\n");
+	dev->timing = saved;
+	dev->timing_name = saved_name;
+	dev->clock_ns = 0;
+	eeprom_update_delays(dev);
+	eeprom_init(dev);
+}
+
+/*
+ * Check whether the EEPROM can be accessed through the PCI VPD capability
+ * and choose the access engine ('sel' is an engine number or -1 for
+ * automatic selection).  The whole EEPROM is read both ways, which checks
+ * the VPD data, finds the order of the 16-bit words in each VPD dword and
+ * times both engines.  VPD is not used if the word order cannot be found.
+ * Automatic selection uses the faster engine.  The bit-bang read also
+ * fills the RAM copy of the EEPROM.
+ */
+static void
+plx905x_setup_engine(struct plx905x_dev *dev, int sel)
+{
+	unsigned int nwords = dev->eeprom_size >> 1;
+	unsigned int i;
+	int match[2] = { 1, 1 };
+	u16 *words;
+	u32 *dwords;
+	u16 lo, hi;
+	int rc;
+#ifdef KCOMPAT_HAVE_KTIME
+	ktime_t t0;
+	u32 bb_ns;
+	u32 vpd_ns;
+#endif
+
+	dev->engine = PLX905X_ENGINE_BITBANG;
+	dev->vpd_cap = pci_find_capability(dev->pcidev, PCI_CAP_ID_VPD);
+	if (!dev->vpd_cap) {
+		goto out;
+	}
+	words = kmalloc(nwords * (sizeof(*words) + sizeof(*dwords) / 2),
+			GFP_KERNEL);
+	if (!words) {
+		dev->vpd_cap = 0;
+		goto out;
+	}
+	dwords = (u32 *)(words + nwords);
+
+#ifdef KCOMPAT_HAVE_KTIME
+	t0 = ktime_get();
+#endif
+	eeprom_init(dev);
+	rc = eeprom_cmd_read_words(dev, 0, words, nwords);
+#ifdef KCOMPAT_HAVE_KTIME
+	bb_ns = (u32)ktime_to_ns(ktime_sub(ktime_get(), t0));
+#endif
+	if (rc) {
+		plxdev_warn(dev, "EEPROM read failed, not checking VPD\n");
+		dev->vpd_cap = 0;
+		goto out_free;
+	}
+#ifdef KCOMPAT_HAVE_KTIME
+	t0 = ktime_get();
+#endif
+	for (i = 0; i < nwords / 2 && !rc; i++) {
+		rc = vpd_read_dword(dev, i, &dwords[i]);
+	}
+#ifdef KCOMPAT_HAVE_KTIME
+	vpd_ns = (u32)ktime_to_ns(ktime_sub(ktime_get(), t0));
+#endif
+	if (rc) {
+		plxdev_warn(dev, "VPD read failed\n");
+		dev->vpd_cap = 0;
+		goto out_free;
+	}
+	if (dev->use_cache) {
+		memcpy(dev->cache, words, nwords * sizeof(*words));
+		set_bit(PLX905X_STATUS_CACHE_VALID, &dev->status);
+	}
+	for (i = 0; i < nwords / 2; i++) {
+		lo = dwords[i];
+		hi = dwords[i] >> 16;
+		if (lo != words[2 * i] || hi != words[2 * i + 1]) {
+			match[0] = 0;
+		}
+		if (hi != words[2 * i] || lo != words[2 * i + 1]) {
+			match[1] = 0;
+		}
+	}
+	if (!match[0] && !match[1]) {
+		plxdev_warn(dev, "VPD data does not match EEPROM\n");
+		dev->vpd_cap = 0;
+		goto out_free;
+	}
+	/*
+	 * If both word orders match (for example, a blank EEPROM), the order
+	 * cannot be told, and guessing wrong would scramble every word
+	 * written through VPD.  Do not use VPD in that case.
+	 */
+	if (match[0] && match[1]) {
+		plxdev_warn(dev, "VPD word order unknown (EEPROM contents "
+			    "are symmetric)\n");
+		dev->vpd_cap = 0;
+		goto out_free;
+	}
+	dev->vpd_swap = !match[0];
+#ifdef KCOMPAT_HAVE_KTIME
+	plxdev_info(dev, "EEPROM read: bit-bang %u us, VPD %u us\n",
+		    bb_ns / 1000, vpd_ns / 1000);
+	if (sel < 0 && vpd_ns < bb_ns) {
+		dev->engine = PLX905X_ENGINE_VPD;
+	}
+#endif
+	if (sel == PLX905X_ENGINE_VPD) {
+		dev->engine = PLX905X_ENGINE_VPD;
+	}
+
+out_free:
+	kfree(words);
+out:
+	if (sel == PLX905X_ENGINE_VPD && dev->engine != PLX905X_ENGINE_VPD) {
+		plxdev_warn(dev, "VPD engine not available\n");
+	}
+	plxdev_info(dev, "using %s engine\n",
+		    plx905x_engine_names[dev->engine]);
+}
+
+/*
+ * Read bytes from the EEPROM into a kernel buffer.  Each 16-bit word of
+ * the EEPROM appears as two bytes in little-endian order.  Returns the
+ * number of bytes read, or a negative error number if nothing was read.
+ * The caller has checked the range and holds the mutex.
+ */
+static ssize_t
+eeprom_read_bytes(struct plx905x_dev *dev, unsigned int pos, u8 *kbuf,
+		  size_t count)
+{
+	ssize_t retval = 0;
+	size_t n;
+	unsigned int addr;
+	unsigned int first = 0;
+	unsigned int nwords = 0;
+	unsigned int last;
+	u16 words[EEPROM_SEQ_READ_WORDS];
+	u16 data;
+
+	last = (pos + count - 1) >> 1;
+	for (addr = pos, n = 0; n < count; addr++, n++) {
+		if ((addr >> 1) >= first + nwords) {
+			/* Read next run of 16-bit words from EEPROM. */
+			first = addr >> 1;
+			nwords = last + 1 - first;
+			if (nwords > EEPROM_SEQ_READ_WORDS) {
+				nwords = EEPROM_SEQ_READ_WORDS;
+			}
+			retval = eeprom_read_words(dev, first, words, nwords);
+			if (retval < 0) {
+				break;
+			}
+		}
+		data = words[(addr >> 1) - first];
+		/* Little-endian order. */
+		*kbuf++ = (addr&1) ? (data>>8) : data;
+	}
+
+	if (n) {
+		retval = n;
+	}
+	return retval;
+}
+
+/*
+ * Build the WRITE command waveforms for the 16-bit words wholly covered by
+ * a range of bytes.  This does not need the mutex.  Words only partly
+ * covered depend on the EEPROM contents, so their waveforms are left empty.
+ * Returns NULL if out of memory.
+ */
+static struct plx905x_wave *
+eeprom_build_write_waves(struct plx905x_dev *dev, unsigned int pos,
+			 const u8 *kbuf, size_t count)
+{
+	struct plx905x_wave *waves;
+	unsigned int first = pos >> 1;
+	unsigned int last = (pos + count - 1) >> 1;
+	unsigned int addr;
+	unsigned int n;
+
+	waves = kmalloc((last + 1 - first) * sizeof(*waves), GFP_KERNEL);
+	if (!waves) {
+		return NULL;
+	}
+	for (addr = first; addr <= last; addr++) {
+		n = (addr << 1) - pos;
+		if ((addr << 1) < pos || n + 1 >= count) {
+			waves[addr - first].len = 0;
+		} else {
+			eeprom_wave_write(dev, &waves[addr - first], addr,
+					  kbuf[n] | (kbuf[n + 1] << 8));
+		}
+	}
+	return waves;
+}
+
+/*
+ * Progress of a write of bytes to the EEPROM, which may be split between
+ * several holds of the mutex.  'words' holds the current contents of a
+ * run of 16-bit words read ahead, which is read again if 'write_gen' shows
+ * the EEPROM may have been changed by someone else in the meantime.
+ */
+struct eeprom_write_state {
+	unsigned int first;
+	unsigned int nwords;
+	unsigned long write_gen;
+	unsigned int nwritten;
+	unsigned int nskipped;
+	u16 words[EEPROM_SEQ_READ_WORDS];
+};
+
+/*
+ * Write bytes from a kernel buffer to the EEPROM, stopping after the first
+ * 16-bit word that is programmed so that the caller can give way.  Each
+ * 16-bit word of the EEPROM appears as two bytes in little-endian order.
+ * 'waves' holds the waveforms prebuilt by eeprom_build_write_waves() for
+ * the range starting at 'pos', or is NULL.  Sets *done to the number of
+ * bytes written (including unchanged ones).  The caller has checked the
+ * range, holds the mutex and has write-enabled the EEPROM.
+ */
+static int
+eeprom_write_bytes(struct plx905x_dev *dev, struct eeprom_write_state *st,
+		   unsigned int pos, const u8 *kbuf, size_t count,
+		   const struct plx905x_wave *waves, size_t *done)
+{
+	const struct plx905x_wave *w;
+	unsigned int last = (pos + count - 1) >> 1;
+	unsigned int addr;
+	unsigned int i;
+	size_t n;
 	u16 data = 0;
+	int retval = 0;
+
+	for (addr = pos, n = 0; n < count; addr++, n++) {
+		u8 byte;
+
+		i = addr >> 1;
+		if (i < st->first || i >= st->first + st->nwords ||
+		    st->write_gen != dev->write_gen) {
+			/*
+			 * Get current contents of next run of 16-bit words
+			 * so that unchanged words need not be programmed.
+			 * This also provides the other half of a 16-bit word
+			 * that is only partly modified at a boundary.
+			 */
+			st->first = i;
+			st->nwords = min_t(unsigned int, last + 1 - i,
+					   EEPROM_SEQ_READ_WORDS);
+			st->write_gen = dev->write_gen;
+			retval = eeprom_read_words(dev, st->first, st->words,
+						   st->nwords);
+			if (retval) {
+				st->nwords = 0;
+				break;
+			}
+		}
+		if ((n == 0) || ((addr&1) == 0)) {
+			data = st->words[i - st->first];
+		}
+		/* Little-endian order. */
+		byte = *kbuf++;
+		if ((addr&1) == 0) {
+			data = (data & 0xFF00) | byte;
+		} else {
+			data = (data & 0x00FF) | (byte << 8);
+		}
+		if (((addr&1) == 0) && (count - n != 1)) {
+			continue;
+		}
+		if (data == st->words[i - st->first]) {
+			/* Already holds the required value. */
+			st->nskipped++;
+			continue;
+		}
+		/* Write 16-bit word to EEPROM. */
+		w = NULL;
+		if (waves && waves[i - (pos >> 1)].len) {
+			w = &waves[i - (pos >> 1)];
+		}
+		retval = eeprom_write_word(dev, i, data, w);
+		if (retval) {
+			if (((addr&1) != 0) && (n > 0)) {
+				n--;
+			}
+			break;
+		}
+		st->words[i - st->first] = data;
+		st->write_gen = dev->write_gen;
+		st->nwritten++;
+		n++;
+		break;
+	}
+	*done = n;
+	return retval;
+}
+
+/*
+ * Lock the mutex for EEPROM access on behalf of an open file, or NULL for
+ * other users.  While an open file holds the user-space access lock, other
+ * users wait for it to be released.
+ */
+static int
+plx905x_lock(struct plx905x_dev *dev, struct plx905x_file *pf)
+{
+	for (;;) {
+		if (mutex_lock_interruptible(&dev->mutex)) {
+			return -ERESTARTSYS;
+		}
+		if (test_bit(PLX905X_STATUS_GONE, &dev->status)) {
+			mutex_unlock(&dev->mutex);
+			return -ENODEV;
+		}
+		if (!dev->lock_owner || dev->lock_owner == pf) {
+			return 0;
+		}
+		mutex_unlock(&dev->mutex);
+		if (wait_event_interruptible(dev->lock_wait,
+				!dev->lock_owner ||
+				test_bit(PLX905X_STATUS_GONE, &dev->status))) {
+			return -ERESTARTSYS;
+		}
+	}
+}
+
+/*
+ * Like plx905x_lock(), but for users other than open files that cannot be
+ * interrupted, such as the kernel threads programming several devices at
+ * once.  Fails with -EBUSY rather than waiting while an open file holds
+ * the user-space access lock, since that may never be released.
+ */
+static int
+plx905x_lock_nowait(struct plx905x_dev *dev)
+{
+	mutex_lock(&dev->mutex);
+	if (test_bit(PLX905X_STATUS_GONE, &dev->status)) {
+		mutex_unlock(&dev->mutex);
+		return -ENODEV;
+	}
+	if (dev->lock_owner) {
+		mutex_unlock(&dev->mutex);
+		return -EBUSY;
+	}
+	return 0;
+}
+
+/*
+ * Note the start and end of a unit of a read or write transfer, during
+ * which the mutex is held, recording the longest.
+ */
+static inline void
+plx905x_hold_start(struct plx905x_dev *dev)
+{
+#ifdef KCOMPAT_HAVE_KTIME
+	dev->hold_start = ktime_get();
+#else
+	dev->hold_start = jiffies;
+#endif
+}
+
+static inline void
+plx905x_hold_end(struct plx905x_dev *dev)
+{
+	unsigned int us;
+
+#ifdef KCOMPAT_HAVE_KTIME
+	us = ktime_to_us(ktime_sub(ktime_get(), dev->hold_start));
+#else
+	us = jiffies_to_msecs(jiffies - dev->hold_start) * 1000;
+#endif
+	if (us > dev->max_hold_us) {
+		dev->max_hold_us = us;
+	}
+}
+
+/*
+ * Give way to other users of the device and of the CPU between units of a
+ * transfer by dropping and retaking the mutex.  Returns 0 with the mutex
+ * held, or a negative error number with it released if a signal is
+ * pending or the device has gone.  A transfer not on behalf of an open
+ * file ('pf' is NULL) fails with -EBUSY if user space has taken the
+ * access lock in the meantime.
+ */
+static int
+plx905x_yield(struct plx905x_dev *dev, struct plx905x_file *pf)
+{
+	int retval;
+
+	plx905x_hold_end(dev);
+	mutex_unlock(&dev->mutex);
+	cond_resched();
+	if (signal_pending(current)) {
+		return -ERESTARTSYS;
+	}
+	retval = pf ? plx905x_lock(dev, pf) : plx905x_lock_nowait(dev);
+	if (retval) {
+		return retval;
+	}
+	plx905x_hold_start(dev);
+	return 0;
+}
+
+/*
+ * Get the number of bytes from 'pos' to read in one unit of a transfer,
+ * so that a unit takes about EEPROM_HOLD_BUDGET_US, but is at least one
+ * word.  Reads from the RAM copy of the EEPROM are not limited.
+ */
+static size_t
+eeprom_read_unit(struct plx905x_dev *dev, unsigned int pos)
+{
+	unsigned int word_ns;
+	unsigned int nwords = EEPROM_SEQ_READ_WORDS;
+	unsigned int i;
+
+	if (dev->use_cache) {
+		for (i = pos >> 1; i < (dev->eeprom_size >> 1); i++) {
+			if (!eeprom_cache_word_valid(dev, i)) {
+				break;
+			}
+		}
+		if (i > (pos >> 1)) {
+			return i * 2 - pos;
+		}
+	}
+	if (dev->engine == PLX905X_ENGINE_BITBANG) {
+		word_ns = 16 * (dev->delay.sk_low + dev->delay.sample +
+				2 * dev->bus_write_ns + dev->bus_read_ns);
+		nwords = EEPROM_HOLD_BUDGET_US * 1000 / max(word_ns, 1u);
+		nwords = clamp_t(unsigned int, nwords, 1,
+				 EEPROM_SEQ_READ_WORDS);
+	}
+	return nwords * 2 - (pos & 1);
+}
+
+/*
+ * Program words of a write session's image that differ from the EEPROM.
+ * The caller holds the mutex, which is dropped and retaken between words
+ * but is held again on return.  If 'intr' is zero, the flush is not
+ * interrupted by signals, and fails with -EBUSY rather than waiting if
+ * another file takes the user-space access lock in the meantime.
+ */
+static int
+session_flush(struct plx905x_file *pf, int intr)
+{
+	struct plx905x_dev *dev = pf->dev;
+	unsigned int nwords = dev->eeprom_size >> 1;
+	unsigned int i;
+	int retval;
+
+	for (i = 0; i < nwords; i++) {
+		if (pf->image[i] != pf->orig[i]) {
+			break;
+		}
+	}
+	if (i == nwords) {
+		return 0;
+	}
+	plx905x_hold_start(dev);
+	retval = eeprom_write_begin(dev);
+	while (!retval) {
+		/* Each word is checked again after retaking the mutex. */
+		if (pf->image[i] != pf->orig[i]) {
+			retval = eeprom_write_word(dev, i, pf->image[i], NULL);
+			if (retval) {
+				break;
+			}
+			pf->orig[i] = pf->image[i];
+		}
+		if (++i == nwords) {
+			break;
+		}
+		if (pf->image[i] == pf->orig[i]) {
+			continue;
+		}
+		if (intr) {
+			retval = plx905x_yield(dev, pf);
+			if (retval) {
+				mutex_lock(&dev->mutex);
+				return retval;
+			}
+		} else {
+			plx905x_hold_end(dev);
+			mutex_unlock(&dev->mutex);
+			cond_resched();
+			mutex_lock(&dev->mutex);
+			if (test_bit(PLX905X_STATUS_GONE, &dev->status)) {
+				return -ENODEV;
+			}
+			if (dev->lock_owner && dev->lock_owner != pf) {
+				return -EBUSY;
+			}
+			plx905x_hold_start(dev);
+		}
+		set_bit(PLX905X_STATUS_CNTRL_STALE, &dev->status);
+		retval = eeprom_write_begin(dev);
+	}
+	plx905x_hold_end(dev);
+	return retval;
+}
+
+/*
+ * Fill the EEPROM with a 16-bit pattern for an ioctl request.  Refused
+ * while another file has a write session, as its buffered data would no
+ * longer be programmed correctly.  The caller holds the mutex.
+ */
+static int
+session_fill(struct plx905x_file *pf, u16 data)
+{
+	struct plx905x_dev *dev = pf->dev;
+	unsigned int i;
+	int retval;
+	int ret;
+
+	if (dev->write_sessions > pf->session) {
+		return -EBUSY;
+	}
+	retval = eeprom_write_begin(dev);
+	if (retval) {
+		return retval;
+	}
+	retval = eeprom_fill(dev, data);
+	if (!retval && pf->session) {
+		/* Discard buffered data. */
+		for (i = 0; i < (dev->eeprom_size >> 1); i++) {
+			pf->image[i] = data;
+			pf->orig[i] = data;
+		}
+	}
+	ret = eeprom_write_end(dev);
+	if (!retval) {
+		retval = ret;
+	}
+	return retval;
+}
+
+/*
+ * Start a write session.  The caller holds the mutex.
+ */
+static int
+session_start(struct plx905x_file *pf)
+{
+	struct plx905x_dev *dev = pf->dev;
+	int retval;
+
+	if (pf->session) {
+		return 0;
+	}
+	retval = eeprom_read_words(dev, 0, pf->orig, dev->eeprom_size >> 1);
+	if (retval) {
+		return retval;
+	}
+	memcpy(pf->image, pf->orig, dev->eeprom_size);
+	retval = eeprom_write_begin(dev);
+	if (retval) {
+		return retval;
+	}
+	pf->session = 1;
+	dev->write_sessions++;
+	return 0;
+}
+
+/*
+ * End a write session after programming any buffered data.  The session
+ * is not ended if the data could not be programmed.  The caller holds the
+ * mutex.
+ */
+static int
+session_end(struct plx905x_file *pf)
+{
+	struct plx905x_dev *dev = pf->dev;
+	int retval;
+
+	if (!pf->session) {
+		return 0;
+	}
+	retval = session_flush(pf, 1);
+	if (retval) {
+		return retval;
+	}
+	pf->session = 0;
+	dev->write_sessions--;
+	return eeprom_write_end(dev);
+}
+
+/*
+ * Free a device when the last reference to it has gone.
+ */
+static void
+plx905x_dev_release(struct kref *kref)
+{
+	struct plx905x_dev *dev = container_of(kref, struct plx905x_dev, kref);
+
+	pci_dev_put(dev->pcidev);
+	kfree(dev);
+}
+
+/*
+ * End the write session of a file being closed, programming its buffered
+ * data, or discarding it if the device has gone.  If another file holds
+ * the user-space access lock, the file is put on the device's 'orphans'
+ * list to be finished when the lock is released, rather than waiting.
+ * Returns 1 if the file was put on the list, otherwise 0 and the caller
+ * frees it.  The caller holds the mutex.
+ */
+static int
+session_close(struct plx905x_file *pf)
+{
+	struct plx905x_dev *dev = pf->dev;
+	int retval = 0;
+
+	if (!pf->session) {
+		return 0;
+	}
+	if (!test_bit(PLX905X_STATUS_GONE, &dev->status)) {
+		if (dev->lock_owner && dev->lock_owner != pf) {
+			retval = -EBUSY;
+		} else {
+			set_bit(PLX905X_STATUS_CNTRL_STALE, &dev->status);
+			retval = session_flush(pf, 0);
+		}
+		if (retval == -EBUSY) {
+			list_add_tail(&pf->orphan, &dev->orphans);
+			return 1;
+		}
+	}
+	pf->session = 0;
+	dev->write_sessions--;
+	if (test_bit(PLX905X_STATUS_GONE, &dev->status)) {
+		return 0;
+	}
+	if (retval) {
+		csdev_err(dev->csdev, "failed to program buffered data (%d)\n",
+			  retval);
+	}
+	eeprom_write_end(dev);
+	return 0;
+}
+
+/*
+ * Finish the write sessions of closed files on the 'orphans' list while
+ * the user-space access lock is free or the device has gone.  The caller
+ * holds the mutex and a reference to the device.
+ */
+static void
+plx905x_end_orphans(struct plx905x_dev *dev)
+{
+	struct plx905x_file *pf;
+
+	while (!list_empty(&dev->orphans) &&
+	       (!dev->lock_owner ||
+		test_bit(PLX905X_STATUS_GONE, &dev->status))) {
+		pf = list_entry(dev->orphans.next, struct plx905x_file,
+				orphan);
+		list_del(&pf->orphan);
+		if (session_close(pf)) {
+			continue;
+		}
+		kfree(pf);
+		kref_put(&dev->kref, plx905x_dev_release);
+	}
+}
+
+/*
+ * Release the user-space access lock.  User space may have left the EEPROM
+ * in any state, so the RAM copy of the EEPROM and the shadow copy of CNTRL
+ * are discarded.  Closed files waiting for the lock are then
+ * finished.  The caller holds the mutex and a reference to the device.
+ */
+static void
+plx905x_user_unlock(struct plx905x_dev *dev)
+{
+	dev->lock_owner = NULL;
+	eeprom_cache_invalidate(dev);
+	clear_bit(PLX905X_STATUS_WRITE_ENABLED, &dev->status);
+	set_bit(PLX905X_STATUS_CNTRL_STALE, &dev->status);
+	eeprom_init(dev);
+	wake_up_all(&dev->lock_wait);
+	plx905x_end_orphans(dev);
+}
+
+static int
+plx905x_open(struct inode *inode, struct file *filp)
+{
+	unsigned int minor = MINOR(inode->i_rdev);
+	struct plx905x_dev *dev = NULL;
+	struct plx905x_file *pf;
+	int retval;
+
+	if (minor == PLX905X_CTL_MINOR) {
+		/* The control device only supports ioctls. */
+		filp->private_data = NULL;
+		filp->f_op = &plx905x_ctl_fops;
+		return 0;
+	}
+	mutex_lock(&plx905x_devs_mutex);
+	if (minor < PLX905X_MAX_DEVICES) {
+		dev = plx905x_devs[minor];
+	}
+	if (dev) {
+		kref_get(&dev->kref);
+	}
+	mutex_unlock(&plx905x_devs_mutex);
+	if (!dev) {
+		return -ENODEV;
+	}
+	/* Wait for EEPROM access to be brought up. */
+	if (wait_for_completion_interruptible(&dev->ready)) {
+		kref_put(&dev->kref, plx905x_dev_release);
+		return -ERESTARTSYS;
+	}
+	pf = kmalloc(sizeof(*pf), GFP_KERNEL);
+	if (!pf) {
+		kref_put(&dev->kref, plx905x_dev_release);
+		return -ENOMEM;
+	}
+	pf->dev = dev;
+	pf->session = 0;
+	filp->private_data = pf;
+	retval = plx905x_lock(dev, pf);
+	if (retval) {
+		kfree(pf);
+		kref_put(&dev->kref, plx905x_dev_release);
+		return retval;
+	}
+	eeprom_init(dev);
+	mutex_unlock(&dev->mutex);
+	return 0;
+}
+
+static int
+plx905x_release(struct inode *inode, struct file *filp)
+{
+	struct plx905x_file *pf = filp->private_data;
+	struct plx905x_dev *dev = pf->dev;
+	int orphaned;
+
+	if (pf->session || dev->lock_owner == pf) {
+		/* Never wait for another file's user-space access lock. */
+		mutex_lock(&dev->mutex);
+		if (dev->lock_owner == pf) {
+			if (test_bit(PLX905X_STATUS_GONE, &dev->status)) {
+				dev->lock_owner = NULL;
+			} else {
+				plx905x_user_unlock(dev);
+			}
+		}
+		orphaned = session_close(pf);
+		mutex_unlock(&dev->mutex);
+		if (orphaned) {
+			return 0;
+		}
+	}
+	kfree(pf);
+	kref_put(&dev->kref, plx905x_dev_release);
+	return 0;
+}
+
+static ssize_t
+plx905x_read(struct file *filp, char *buf, size_t count, loff_t *f_pos)
+{
+	struct plx905x_file *pf = filp->private_data;
+	struct plx905x_dev *dev = pf->dev;
+	ssize_t retval = 0;
+	ssize_t ret;
+	unsigned long left;
+	unsigned int addr;
+	size_t n;
+	size_t unit;
+	int locked = 1;
+	u16 data;
+	u8 *kbuf;
+
+	if (*f_pos >= dev->eeprom_size) {
+		return 0;
+	}
+	if (*f_pos + count > dev->eeprom_size) {
+		count = dev->eeprom_size - *f_pos;
+	}
+	if (count == 0) {
+		return 0;
+	}
+	kbuf = kmalloc(count, GFP_KERNEL);
+	if (!kbuf) {
+		return -ENOMEM;
+	}
+	retval = plx905x_lock(dev, pf);
+	if (retval) {
+		kfree(kbuf);
+		return retval;
+	}
+	if (pf->session) {
+		/* Read from the write session's image. */
+		for (n = 0; n < count; n++) {
+			addr = *f_pos + n;
+			data = pf->image[addr >> 1];
+			kbuf[n] = (addr&1) ? (data>>8) : data;
+		}
+		retval = count;
+	} else {
+		/* Read in units of bounded length, giving way in between. */
+		plx905x_hold_start(dev);
+		for (n = 0; n < count; n += unit) {
+			if (n && plx905x_yield(dev, pf)) {
+				locked = 0;
+				break;
+			}
+			addr = *f_pos + n;
+			unit = min(count - n, eeprom_read_unit(dev, addr));
+			set_bit(PLX905X_STATUS_CNTRL_STALE, &dev->status);
+			ret = eeprom_read_bytes(dev, addr, kbuf + n, unit);
+			if (ret != unit) {
+				if (ret > 0) {
+					n += ret;
+				} else {
+					retval = ret;
+				}
+				break;
+			}
+		}
+		if (locked) {
+			plx905x_hold_end(dev);
+		}
+		if (n) {
+			retval = n;
+		}
+	}
+	if (locked) {
+		mutex_unlock(&dev->mutex);
+	}
+
+	if (retval > 0) {
+		/* Copy to user without holding the mutex. */
+		left = copy_to_user(buf, kbuf, retval);
+		if (left == retval) {
+			retval = -EFAULT;
+		} else {
+			retval -= left;
+			*f_pos += retval;
+		}
+	}
+	kfree(kbuf);
+	return retval;
+}
+
+/*
+ * Program bytes into the EEPROM a word at a time, giving way in between.
+ * The EEPROM is write-enabled once for the whole range.  The caller holds
+ * the mutex, which is released on return.  Returns the number of bytes
+ * programmed or a negative error number if none were.
+ */
+static ssize_t
+plx905x_program(struct plx905x_dev *dev, struct plx905x_file *pf,
+		unsigned int pos, const u8 *kbuf, size_t count,
+		const struct plx905x_wave *waves)
+{
+	struct eeprom_write_state st;
+	ssize_t retval;
+	size_t n = 0;
+	size_t done;
+	int ret;
+
+	st.nwords = 0;
+	st.nwritten = 0;
+	st.nskipped = 0;
+	plx905x_hold_start(dev);
+	set_bit(PLX905X_STATUS_CNTRL_STALE, &dev->status);
+	retval = eeprom_write_begin(dev);
+	while (!retval) {
+		ret = eeprom_write_bytes(dev, &st, pos + n, kbuf + n, count - n,
+			waves ? &waves[((pos + n) >> 1) - (pos >> 1)] : NULL,
+			&done);
+		n += done;
+		if (ret || n == count) {
+			retval = ret;
+			break;
+		}
+		ret = plx905x_yield(dev, pf);
+		if (ret) {
+			/* Retake the mutex to write-disable the EEPROM. */
+			mutex_lock(&dev->mutex);
+			plx905x_hold_start(dev);
+			retval = ret;
+			break;
+		}
+		/* Someone else may have write-disabled it. */
+		set_bit(PLX905X_STATUS_CNTRL_STALE, &dev->status);
+		retval = eeprom_write_begin(dev);
+	}
+	if (!test_bit(PLX905X_STATUS_GONE, &dev->status) &&
+	    (!dev->lock_owner || dev->lock_owner == pf)) {
+		ret = eeprom_write_end(dev);
+		if (!retval) {
+			retval = ret;
+		}
+	}
+	plx905x_hold_end(dev);
+	mutex_unlock(&dev->mutex);
+
+	csdev_dbglvl(2, dev->csdev, "programmed %u words, skipped %u words\n",
+		     st.nwritten, st.nskipped);
+
+	if (n) {
+		retval = n;
+	}
+	return retval;
+}
+
+static ssize_t
+plx905x_write(struct file *filp, const char *buf, size_t count, loff_t *f_pos)
+{
+	struct plx905x_file *pf = filp->private_data;
+	struct plx905x_dev *dev = pf->dev;
+	struct plx905x_wave *waves = NULL;
+	ssize_t retval = 0;
+	unsigned int addr;
+	size_t n;
+	u16 *word;
+	u8 *kbuf;
+
+	if (*f_pos > dev->eeprom_size) {
+		return -ENOSPC;
+	}
+	if (count == 0) {
+		return 0;
+	}
+	if (*f_pos + count > dev->eeprom_size) {
+		count = dev->eeprom_size - *f_pos;
+		if (count == 0)
+			return -ENOSPC;
+	}
+	kbuf = kmalloc(count, GFP_KERNEL);
+	if (!kbuf) {
+		return -ENOMEM;
+	}
+	/* Copy from user without holding the mutex. */
+	if (copy_from_user(kbuf, buf, count)) {
+		kfree(kbuf);
+		return -EFAULT;
+	}
+	/*
+	 * Prebuild the bit-bang waveforms so that the mutex is only held
+	 * while they are replayed.  This is just an optimization, so carry
+	 * on without them if out of memory.
+	 */
+	if (!pf->session && dev->engine == PLX905X_ENGINE_BITBANG) {
+		waves = eeprom_build_write_waves(dev, *f_pos, kbuf, count);
+	}
+	retval = plx905x_lock(dev, pf);
+	if (retval) {
+		kfree(waves);
+		kfree(kbuf);
+		return retval;
+	}
+	if (pf->session) {
+		/* Buffer in the write session's image. */
+		for (n = 0; n < count; n++) {
+			addr = *f_pos + n;
+			word = &pf->image[addr >> 1];
+			if ((addr&1) == 0) {
+				*word = (*word & 0xFF00) | kbuf[n];
+			} else {
+				*word = (*word & 0x00FF) | (kbuf[n] << 8);
+			}
+		}
+		retval = count;
+		mutex_unlock(&dev->mutex);
+	} else {
+		retval = plx905x_program(dev, pf, *f_pos, kbuf, count, waves);
+	}
+
+	if (retval > 0) {
+		*f_pos += retval;
+	}
+	kfree(waves);
+	kfree(kbuf);
+	return retval;
+}
+
+static loff_t
+plx905x_llseek(struct file *filp, loff_t off, int whence)
+{
+	struct plx905x_file *pf = filp->private_data;
+	struct plx905x_dev *dev = pf->dev;
+	loff_t pos;
+
+	switch (whence) {
+	case 0:	/* SEEK_SET */
+		pos = 0;
+		break;
+	case 1:	/* SEEK_CUR */
+		pos = filp->f_pos;
+		break;
+	case 2:	/* SEEK_END */
+		pos = dev->eeprom_size;
+		break;
+	default:	/* cannot happen */
+		return -EINVAL;
+	}
+	pos += off;
+	if ((pos < 0) || (pos > dev->eeprom_size)) {
+		return -EINVAL;
+	}
+	filp->f_pos = pos;
+	return pos;
+}
+
+#if defined(KCOMPAT_FOP_FSYNC_HAS_START_END)
+static int
+plx905x_fsync(struct file *filp, loff_t start, loff_t end, int datasync)
+#elif defined(KCOMPAT_FOP_FSYNC_HAS_DENTRY)
+static int
+plx905x_fsync(struct file *filp, struct dentry *dentry, int datasync)
+#else
+static int
+plx905x_fsync(struct file *filp, int datasync)
+#endif
+{
+	struct plx905x_file *pf = filp->private_data;
+	struct plx905x_dev *dev = pf->dev;
+	int retval;
+
+	if (!pf->session) {
+		return 0;
+	}
+	retval = plx905x_lock(dev, pf);
+	if (retval) {
+		return retval;
+	}
+	set_bit(PLX905X_STATUS_CNTRL_STALE, &dev->status);
+	retval = session_flush(pf, 1);
+	mutex_unlock(&dev->mutex);
+	return retval;
+}
+
+/*
+ * Get information for user-space access to the EEPROM.
+ */
+static void
+plx905x_get_info(struct plx905x_dev *dev, struct plx905x_info *info)
+{
+	memset(info, 0, sizeof(*info));
+	info->pci_domain = pci_domain_nr(dev->pcidev->bus);
+	info->pci_bus = dev->pcidev->bus->number;
+	info->pci_devfn = dev->pcidev->devfn;
+	if (dev->iospace == IORESOURCE_IO) {
+		info->bar = 1;
+		info->bar_is_io = 1;
+	}
+	info->cntrl = dev->cntrl;
+	info->eemask = dev->cntrl_eemask;
+	info->eeprom_size = dev->eeprom_size;
+	info->eeprom_addr_len = dev->eeprom_addr_len;
+	info->sk_low_ns = dev->timing.sk_low;
+	info->sk_high_ns = dev->timing.sk_high;
+	info->cs_low_ns = dev->timing.cs_low;
+	info->do_valid_ns = dev->timing.do_valid;
+}
+
+static long
+plx905x_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct plx905x_file *pf = filp->private_data;
+	struct plx905x_dev *dev = pf->dev;
+	struct plx905x_info info;
+	long retval;
+
+	switch (cmd) {
+	case PLX905X_IOCTL_WRITE_SESSION:
+		if (!(filp->f_mode & FMODE_WRITE)) {
+			return -EBADF;
+		}
+		retval = plx905x_lock(dev, pf);
+		if (retval) {
+			return retval;
+		}
+		set_bit(PLX905X_STATUS_CNTRL_STALE, &dev->status);
+		if (arg) {
+			retval = session_start(pf);
+		} else {
+			retval = session_end(pf);
+		}
+		mutex_unlock(&dev->mutex);
+		break;
+	case PLX905X_IOCTL_RELOAD:
+		if (!(filp->f_mode & FMODE_WRITE)) {
+			return -EBADF;
+		}
+		retval = plx905x_lock(dev, pf);
+		if (retval) {
+			return retval;
+		}
+		set_bit(PLX905X_STATUS_CNTRL_STALE, &dev->status);
+		/* Program this file's buffered data first. */
+		retval = pf->session ? session_flush(pf, 1) : 0;
+		if (!retval) {
+			plx905x_reload_config(dev);
+		}
+		mutex_unlock(&dev->mutex);
+		break;
+	case PLX905X_IOCTL_ERASE_ALL:
+	case PLX905X_IOCTL_WRITE_ALL:
+		if (!(filp->f_mode & FMODE_WRITE)) {
+			return -EBADF;
+		}
+		if (cmd == PLX905X_IOCTL_ERASE_ALL) {
+			arg = 0xFFFF;
+		} else if (arg > 0xFFFF) {
+			return -EINVAL;
+		}
+		retval = plx905x_lock(dev, pf);
+		if (retval) {
+			return retval;
+		}
+		set_bit(PLX905X_STATUS_CNTRL_STALE, &dev->status);
+		retval = session_fill(pf, arg);
+		mutex_unlock(&dev->mutex);
+		break;
+	case PLX905X_IOCTL_LOCK:
+		if (!(filp->f_mode & FMODE_WRITE)) {
+			return -EBADF;
+		}
+		retval = plx905x_lock(dev, pf);
+		if (retval) {
+			return retval;
+		}
+		dev->lock_owner = pf;
+		mutex_unlock(&dev->mutex);
+		retval = 0;
+		break;
+	case PLX905X_IOCTL_UNLOCK:
+		if (mutex_lock_interruptible(&dev->mutex)) {
+			return -ERESTARTSYS;
+		}
+		if (test_bit(PLX905X_STATUS_GONE, &dev->status)) {
+			if (dev->lock_owner == pf) {
+				dev->lock_owner = NULL;
+			}
+			retval = -ENODEV;
+		} else if (dev->lock_owner == pf) {
+			plx905x_user_unlock(dev);
+			retval = 0;
+		} else {
+			retval = -EPERM;
+		}
+		mutex_unlock(&dev->mutex);
+		break;
+	case PLX905X_IOCTL_GET_INFO:
+		plx905x_get_info(dev, &info);
+		if (copy_to_user((void __user *)arg, &info, sizeof(info))) {
+			return -EFAULT;
+		}
+		retval = 0;
+		break;
+	default:
+		retval = -ENOTTY;
+		break;
+	}
+	return retval;
+}
+
+#ifndef HAVE_UNLOCKED_IOCTL
+static int
+plx905x_ioctl(struct inode *inode, struct file *filp, unsigned int cmd,
+	      unsigned long arg)
+{
+	return plx905x_unlocked_ioctl(filp, cmd, arg);
+}
+#endif
+
+#ifdef HAVE_COMPAT_IOCTL
+static long
+plx905x_compat_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	if (cmd == PLX905X_IOCTL_GET_INFO) {
+		arg = (unsigned long)compat_ptr(arg);
+	}
+	return plx905x_unlocked_ioctl(filp, cmd, arg);
+}
+#endif
+
+/*
+ * Broadcast programming of an image to several devices.
+ */
+struct plx905x_job {
+	struct plx905x_dev *dev;
+	const u8 *image;
+	size_t size;
+	int status;
+	struct completion done;
+};
+
+static int
+plx905x_program_image(struct plx905x_dev *dev, const u8 *image, size_t size)
+{
+	struct plx905x_wave *waves = NULL;
+	ssize_t ret;
+
+	wait_for_completion(&dev->ready);
+	if (size > dev->eeprom_size) {
+		return -ENOSPC;
+	}
+	if (dev->engine == PLX905X_ENGINE_BITBANG) {
+		waves = eeprom_build_write_waves(dev, 0, image, size);
+	}
+	ret = plx905x_lock_nowait(dev);
+	if (!ret) {
+		ret = plx905x_program(dev, NULL, 0, image, size, waves);
+		if (ret >= 0 && ret != size) {
+			ret = -EIO;
+		}
+	}
+	kfree(waves);
+	return ret < 0 ? ret : 0;
+}
+
+#ifdef KCOMPAT_HAVE_LINUX_KTHREAD_H
+static int
+plx905x_job_thread(void *arg)
+{
+	struct plx905x_job *job = arg;
+
+	job->status = plx905x_program_image(job->dev, job->image, job->size);
+	complete(&job->done);
+	/* Wait to be reaped by kthread_stop(). */
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+#endif
+
+/*
+ * Program an image into each selected device, using a kernel thread per
+ * device so that their programming cycles overlap.  If a thread cannot
+ * be created, that device is programmed by the caller.
+ */
+static long
+plx905x_program_all(struct plx905x_program_all __user *uarg)
+{
+	struct plx905x_program_all req;
+	struct plx905x_job *jobs;
+	struct plx905x_job *job;
+#ifdef KCOMPAT_HAVE_LINUX_KTHREAD_H
+	struct task_struct *tasks[PLX905X_MAX_DEVICES] = { NULL };
+#endif
+	unsigned int minor;
+	long retval = 0;
+	u8 *image;
+
+	if (copy_from_user(&req, uarg, sizeof(req))) {
+		return -EFAULT;
+	}
+	if (req.size == 0 || req.size > CS66_EEPROM_SIZE || req.mask == 0 ||
+	    (req.mask >> (PLX905X_MAX_DEVICES - 1)) > 1) {
+		return -EINVAL;
+	}
+	image = kmalloc(req.size, GFP_KERNEL);
+	if (!image) {
+		return -ENOMEM;
+	}
+	if (copy_from_user(image, u64_to_user_ptr(req.image), req.size)) {
+		kfree(image);
+		return -EFAULT;
+	}
+	jobs = kzalloc(PLX905X_MAX_DEVICES * sizeof(*jobs), GFP_KERNEL);
+	if (!jobs) {
+		kfree(image);
+		return -ENOMEM;
+	}
+
+	/* Take a reference to each selected device. */
+	mutex_lock(&plx905x_devs_mutex);
+	for (minor = 0; minor < PLX905X_MAX_DEVICES; minor++) {
+		job = &jobs[minor];
+		if (!(req.mask & (1U << minor))) {
+			continue;
+		}
+		job->dev = plx905x_devs[minor];
+		if (job->dev) {
+			kref_get(&job->dev->kref);
+		} else {
+			job->status = -ENODEV;
+		}
+	}
+	mutex_unlock(&plx905x_devs_mutex);
+
+	/* Start them off. */
+	for (minor = 0; minor < PLX905X_MAX_DEVICES; minor++) {
+		job = &jobs[minor];
+		if (!job->dev) {
+			continue;
+		}
+		job->image = image;
+		job->size = req.size;
+		init_completion(&job->done);
+#ifdef KCOMPAT_HAVE_LINUX_KTHREAD_H
+		tasks[minor] = kthread_run(plx905x_job_thread, job, "%s",
+					   job->dev->name);
+		if (IS_ERR(tasks[minor])) {
+			tasks[minor] = NULL;
+		}
+		if (tasks[minor]) {
+			continue;
+		}
+#endif
+		job->status = plx905x_program_image(job->dev, image, req.size);
+		complete(&job->done);
+	}
+
+	/* Wait for them to finish. */
+	for (minor = 0; minor < PLX905X_MAX_DEVICES; minor++) {
+		job = &jobs[minor];
+		if (job->dev) {
+			wait_for_completion(&job->done);
+#ifdef KCOMPAT_HAVE_LINUX_KTHREAD_H
+			if (tasks[minor]) {
+				kthread_stop(tasks[minor]);
+			}
+#endif
+			kref_put(&job->dev->kref, plx905x_dev_release);
+		}
+		req.status[minor] = job->status;
+		if (job->status) {
+			retval = -EIO;
+		}
+	}
+
+	if (copy_to_user(uarg->status, req.status, sizeof(req.status))) {
+		retval = -EFAULT;
+	}
+	kfree(jobs);
+	kfree(image);
+	return retval;
+}
+
+static long
+plx905x_ctl_unlocked_ioctl(struct file *filp, unsigned int cmd,
+			   unsigned long arg)
+{
+	switch (cmd) {
+	case PLX905X_IOCTL_PROGRAM_ALL:
+		if (!(filp->f_mode & FMODE_WRITE)) {
+			return -EBADF;
+		}
+		return plx905x_program_all((void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+#ifndef HAVE_UNLOCKED_IOCTL
+static int
+plx905x_ctl_ioctl(struct inode *inode, struct file *filp, unsigned int cmd,
+		  unsigned long arg)
+{
+	return plx905x_ctl_unlocked_ioctl(filp, cmd, arg);
+}
+#endif
+
+#ifdef HAVE_COMPAT_IOCTL
+static long
+plx905x_ctl_compat_ioctl(struct file *filp, unsigned int cmd,
+			 unsigned long arg)
+{
+	return plx905x_ctl_unlocked_ioctl(filp, cmd,
+					  (unsigned long)compat_ptr(arg));
+}
+#endif
+
+#ifdef KCOMPAT_NO_CLASS_DEVICE
+/*
+ * Sysfs device attributes (for 2.6.26 or later kernel).
+ */
+
+/*
+ * Wait for EEPROM access to be brought up before an attribute changes the
+ * EEPROM settings or accesses the hardware.
+ */
+static int
+plx905x_wait_ready(struct plx905x_dev *dev)
+{
+	if (wait_for_completion_interruptible(&dev->ready)) {
+		return -ERESTARTSYS;
+	}
+	if (test_bit(PLX905X_STATUS_GONE, &dev->status)) {
+		return -ENODEV;
+	}
+	return 0;
+}
+
+static ssize_t
+cache_show(struct device *csdev, struct device_attribute *attr, char *buf)
+{
+	struct plx905x_dev *dev = dev_get_drvdata(csdev);
 
-	if (*f_pos >= dev->eeprom_size) {
-		return 0;
+	return sprintf(buf, "%u\n", dev->use_cache);
+}
+
+static ssize_t
+cache_store(struct device *csdev, struct device_attribute *attr,
+	    const char *buf, size_t count)
+{
+	struct plx905x_dev *dev = dev_get_drvdata(csdev);
+	unsigned long val;
+	char *end;
+
+	val = simple_strtoul(buf, &end, 0);
+	if (end == buf || val > 1) {
+		return -EINVAL;
 	}
-	if (*f_pos + count > dev->eeprom_size) {
-		count = dev->eeprom_size - *f_pos;
+	if (mutex_lock_interruptible(&dev->mutex)) {
+		return -ERESTARTSYS;
 	}
+	dev->use_cache = val;
+	if (!val) {
+		eeprom_cache_invalidate(dev);
+	}
+	mutex_unlock(&dev->mutex);
+	return count;
+}
+
+static ssize_t
+cache_invalidate_store(struct device *csdev, struct device_attribute *attr,
+		       const char *buf, size_t count)
+{
+	struct plx905x_dev *dev = dev_get_drvdata(csdev);
+
 	if (mutex_lock_interruptible(&dev->mutex)) {
 		return -ERESTARTSYS;
 	}
-	if (!kcompat_access_ok(buf, count)) {
-		retval = -EFAULT;
-		goto out;
+	eeprom_cache_invalidate(dev);
+	mutex_unlock(&dev->mutex);
+	return count;
+}
+
+static ssize_t
+reload_store(struct device *csdev, struct device_attribute *attr,
+	     const char *buf, size_t count)
+{
+	struct plx905x_dev *dev = dev_get_drvdata(csdev);
+	int retval;
+
+	retval = plx905x_wait_ready(dev);
+	if (retval) {
+		return retval;
+	}
+	retval = plx905x_lock(dev, NULL);
+	if (retval) {
+		return retval;
 	}
+	set_bit(PLX905X_STATUS_CNTRL_STALE, &dev->status);
+	plx905x_reload_config(dev);
+	mutex_unlock(&dev->mutex);
+	return count;
+}
 
-	for (addr = *f_pos, n = 0; n < count; addr++, n++) {
-		if ((n == 0) || ((addr & 1) == 0)) {
-			/* Read 16-bit word from EEPROM. */
-			retval = eeprom_cmd_read_word(dev, addr>>1, &data);
-			if (retval < 0) {
-				break;
-			}
-		}
-		/* Put data to the user in little-endian order. */
-		__put_user(((addr&1) ? (data>>8) : data), buf++);
+static ssize_t
+timing_show(struct device *csdev, struct device_attribute *attr, char *buf)
+{
+	struct plx905x_dev *dev = dev_get_drvdata(csdev);
+
+	return sprintf(buf, "%s\n", dev->timing_name);
+}
+
+static ssize_t
+timing_store(struct device *csdev, struct device_attribute *attr,
+	     const char *buf, size_t count)
+{
+	struct plx905x_dev *dev = dev_get_drvdata(csdev);
+	const struct plx905x_timing_profile *profile;
+	int retval;
+
+	profile = plx905x_find_timing_profile(buf);
+	if (!profile) {
+		return -EINVAL;
+	}
+	retval = plx905x_wait_ready(dev);
+	if (retval) {
+		return retval;
+	}
+	if (mutex_lock_interruptible(&dev->mutex)) {
+		return -ERESTARTSYS;
 	}
+	dev->timing_name = profile->name;
+	dev->timing = profile->timing;
+	dev->clock_ns = 0;
+	eeprom_update_delays(dev);
+	mutex_unlock(&dev->mutex);
+	return count;
+}
 
-	if (n) {
-		retval = n;
-		*f_pos += n;
+static ssize_t
+engine_show(struct device *csdev, struct device_attribute *attr, char *buf)
+{
+	struct plx905x_dev *dev = dev_get_drvdata(csdev);
+
+	return sprintf(buf, "%s\n", plx905x_engine_names[dev->engine]);
+}
+
+static ssize_t
+engine_store(struct device *csdev, struct device_attribute *attr,
+	     const char *buf, size_t count)
+{
+	struct plx905x_dev *dev = dev_get_drvdata(csdev);
+	int retval;
+	int sel;
+
+	sel = plx905x_find_engine(buf);
+	if (sel < 0) {
+		return -EINVAL;
+	}
+	retval = plx905x_wait_ready(dev);
+	if (retval) {
+		return retval;
+	}
+	if (sel == PLX905X_ENGINE_VPD && !dev->vpd_cap) {
+		return -ENODEV;
+	}
+	if (mutex_lock_interruptible(&dev->mutex)) {
+		return -ERESTARTSYS;
 	}
+	dev->engine = sel;
+	mutex_unlock(&dev->mutex);
+	return count;
+}
 
-out:
+/*
+ * Store a single timing parameter.  This changes the timing profile name
+ * to "custom".
+ */
+static ssize_t
+plx905x_timing_param_store(struct plx905x_dev *dev, unsigned int *param,
+			   const char *buf, size_t count)
+{
+	unsigned long val;
+	char *end;
+	int retval;
+
+	val = simple_strtoul(buf, &end, 0);
+	if (end == buf || val > EEPROM_MAX_DELAY_NS) {
+		return -EINVAL;
+	}
+	retval = plx905x_wait_ready(dev);
+	if (retval) {
+		return retval;
+	}
+	if (mutex_lock_interruptible(&dev->mutex)) {
+		return -ERESTARTSYS;
+	}
+	*param = val;
+	dev->timing_name = "custom";
+	dev->clock_ns = 0;
+	eeprom_update_delays(dev);
 	mutex_unlock(&dev->mutex);
-	return retval;
+	return count;
 }
 
+#define PLX905X_TIMING_PARAM_ATTR(_param)				\
+static ssize_t								\
+_param##_ns_show(struct device *csdev, struct device_attribute *attr,	\
+		 char *buf)						\
+{									\
+	struct plx905x_dev *dev = dev_get_drvdata(csdev);		\
+									\
+	return sprintf(buf, "%u\n", dev->timing._param);		\
+}									\
+static ssize_t								\
+_param##_ns_store(struct device *csdev, struct device_attribute *attr,	\
+		  const char *buf, size_t count)			\
+{									\
+	struct plx905x_dev *dev = dev_get_drvdata(csdev);		\
+									\
+	return plx905x_timing_param_store(dev, &dev->timing._param,	\
+					  buf, count);			\
+}									\
+static DEVICE_ATTR_RW(_param##_ns)
+
+PLX905X_TIMING_PARAM_ATTR(sk_low);
+PLX905X_TIMING_PARAM_ATTR(sk_high);
+PLX905X_TIMING_PARAM_ATTR(cs_low);
+PLX905X_TIMING_PARAM_ATTR(do_valid);
+
 static ssize_t
-plx905x_write(struct file *filp, const char *buf, size_t count, loff_t *f_pos)
+clock_ns_show(struct device *csdev, struct device_attribute *attr, char *buf)
 {
-	struct plx905x_dev *dev = filp->private_data;
-	ssize_t retval = 0;
-	int ret;
-	size_t n = 0;
-	unsigned int addr;
-	u16 data = 0;
+	struct plx905x_dev *dev = dev_get_drvdata(csdev);
 
-	if (*f_pos > dev->eeprom_size) {
-		return -ENOSPC;
+	return sprintf(buf, "%u\n", dev->clock_ns);
+}
+
+static ssize_t
+clock_ns_store(struct device *csdev, struct device_attribute *attr,
+	       const char *buf, size_t count)
+{
+	struct plx905x_dev *dev = dev_get_drvdata(csdev);
+	unsigned long val;
+	char *end;
+	int retval;
+
+	val = simple_strtoul(buf, &end, 0);
+	if (end == buf || val == 0 || val > EEPROM_MAX_DELAY_NS) {
+		return -EINVAL;
 	}
-	if (count == 0) {
-		return 0;
+	retval = plx905x_wait_ready(dev);
+	if (retval) {
+		return retval;
 	}
-	if (*f_pos + count > dev->eeprom_size) {
-		count = dev->eeprom_size - *f_pos;
-		if (count == 0)
-			return -ENOSPC;
+	if (mutex_lock_interruptible(&dev->mutex)) {
+		return -ERESTARTSYS;
+	}
+	plx905x_set_clock(dev, val);
+	mutex_unlock(&dev->mutex);
+	return count;
+}
+
+static ssize_t
+bus_read_ns_show(struct device *csdev, struct device_attribute *attr,
+		 char *buf)
+{
+	struct plx905x_dev *dev = dev_get_drvdata(csdev);
+
+	return sprintf(buf, "%u\n", dev->bus_read_ns);
+}
+
+static ssize_t
+bus_write_ns_show(struct device *csdev, struct device_attribute *attr,
+		  char *buf)
+{
+	struct plx905x_dev *dev = dev_get_drvdata(csdev);
+
+	return sprintf(buf, "%u\n", dev->bus_write_ns);
+}
+
+static ssize_t
+twp_us_show(struct device *csdev, struct device_attribute *attr, char *buf)
+{
+	struct plx905x_dev *dev = dev_get_drvdata(csdev);
+
+	return sprintf(buf, "%u\n", dev->twp_us);
+}
+
+static ssize_t
+io_retries_show(struct device *csdev, struct device_attribute *attr,
+		char *buf)
+{
+	struct plx905x_dev *dev = dev_get_drvdata(csdev);
+
+	return sprintf(buf, "%lu\n", dev->io_retries);
+}
+
+static ssize_t
+io_errors_show(struct device *csdev, struct device_attribute *attr,
+	       char *buf)
+{
+	struct plx905x_dev *dev = dev_get_drvdata(csdev);
+
+	return sprintf(buf, "%lu\n", dev->io_errors);
+}
+
+static ssize_t
+max_hold_us_show(struct device *csdev, struct device_attribute *attr,
+		 char *buf)
+{
+	struct plx905x_dev *dev = dev_get_drvdata(csdev);
+
+	return sprintf(buf, "%u\n", dev->max_hold_us);
+}
+
+static ssize_t
+max_hold_us_store(struct device *csdev, struct device_attribute *attr,
+		  const char *buf, size_t count)
+{
+	struct plx905x_dev *dev = dev_get_drvdata(csdev);
+	unsigned long val;
+	char *end;
+
+	val = simple_strtoul(buf, &end, 0);
+	if (end == buf || val != 0) {
+		return -EINVAL;
 	}
 	if (mutex_lock_interruptible(&dev->mutex)) {
 		return -ERESTARTSYS;
 	}
-	if (!kcompat_access_ok(buf, count)) {
-		retval = -EFAULT;
-		goto out;
+	dev->max_hold_us = 0;
+	mutex_unlock(&dev->mutex);
+	return count;
+}
+
+static DEVICE_ATTR_RW(cache);
+static DEVICE_ATTR_RW(timing);
+static DEVICE_ATTR_RW(clock_ns);
+static DEVICE_ATTR_RW(engine);
+static DEVICE_ATTR_RO(bus_read_ns);
+static DEVICE_ATTR_RO(bus_write_ns);
+static DEVICE_ATTR_RO(twp_us);
+static DEVICE_ATTR_RO(io_retries);
+static DEVICE_ATTR_RO(io_errors);
+static DEVICE_ATTR_RW(max_hold_us);
+static DEVICE_ATTR(cache_invalidate, S_IWUSR, NULL, cache_invalidate_store);
+static DEVICE_ATTR(reload, S_IWUSR, NULL, reload_store);
+
+static struct attribute *plx905x_attrs[] = {
+	&dev_attr_cache.attr,
+	&dev_attr_cache_invalidate.attr,
+	&dev_attr_timing.attr,
+	&dev_attr_sk_low_ns.attr,
+	&dev_attr_sk_high_ns.attr,
+	&dev_attr_cs_low_ns.attr,
+	&dev_attr_do_valid_ns.attr,
+	&dev_attr_clock_ns.attr,
+	&dev_attr_bus_read_ns.attr,
+	&dev_attr_bus_write_ns.attr,
+	&dev_attr_twp_us.attr,
+	&dev_attr_io_retries.attr,
+	&dev_attr_io_errors.attr,
+	&dev_attr_max_hold_us.attr,
+	&dev_attr_engine.attr,
+	&dev_attr_reload.attr,
+	NULL
+};
+
+#ifdef KCOMPAT_USE_CLASS_DEV_GROUPS
+/*
+ * Hide the attributes on the control device, which has no plx905x_dev.
+ */
+static umode_t
+plx905x_attr_is_visible(struct kobject *kobj, struct attribute *attr, int n)
+{
+	struct device *csdev = container_of(kobj, struct device, kobj);
+
+	return dev_get_drvdata(csdev) ? attr->mode : 0;
+}
+#endif
+
+static const struct attribute_group plx905x_attr_group = {
+	.attrs = plx905x_attrs,
+#ifdef KCOMPAT_USE_CLASS_DEV_GROUPS
+	.is_visible = plx905x_attr_is_visible,
+#endif
+};
+
+#ifdef KCOMPAT_USE_CLASS_DEV_GROUPS
+static const struct attribute_group *plx905x_attr_groups[] = {
+	&plx905x_attr_group,
+	NULL
+};
+#endif
+#endif	/* KCOMPAT_NO_CLASS_DEVICE */
+
+static struct file_operations plx905x_fops = {
+	.owner = THIS_MODULE,
+	.llseek = plx905x_llseek,
+	.read = plx905x_read,
+	.write = plx905x_write,
+	.open = plx905x_open,
+	.release = plx905x_release,
+	.fsync = plx905x_fsync,
+#ifdef HAVE_UNLOCKED_IOCTL
+	.unlocked_ioctl = plx905x_unlocked_ioctl,
+#else
+	.ioctl = plx905x_ioctl,
+#endif
+#ifdef HAVE_COMPAT_IOCTL
+	.compat_ioctl = plx905x_compat_ioctl,
+#endif
+};
+
+static struct file_operations plx905x_ctl_fops = {
+	.owner = THIS_MODULE,
+#ifdef HAVE_UNLOCKED_IOCTL
+	.unlocked_ioctl = plx905x_ctl_unlocked_ioctl,
+#else
+	.ioctl = plx905x_ctl_ioctl,
+#endif
+#ifdef HAVE_COMPAT_IOCTL
+	.compat_ioctl = plx905x_ctl_compat_ioctl,
+#endif
+};
+
+#ifdef CONFIG_DEVFS_FS
+/*
+ * Register a device name with DevFS for older kernels.  Failure is not
+ * fatal.
+ */
+static void
+plx905x_devfs_register(unsigned int minor, const char *name,
+		       unsigned long *status)
+{
+	int rc = 0;
+
+#if defined(KCOMPAT_HAVE_DEVFS_24)
+	/* Register device with DevFS (for 2.4 kernels). */
+	if (!devfs_register(NULL, name, DEVFS_FL_DEFAULT, major, minor,
+			    (S_IFCHR | S_IRUSR | S_IWUSR),
+			    (struct file_operations *)&plx905x_fops, NULL)) {
+		/* Error number is not accurate. */
+		rc = -EINVAL;
+	}
+#elif defined(KCOMPAT_HAVE_DEVFS_26)
+	/* Register device with DevFS (for early 2.6 kernels). */
+	rc = devfs_mk_cdev(MKDEV(major, minor),
+			   (S_IFCHR | S_IRUSR | S_IWUSR), "%s", name);
+#endif
+	if (rc) {
+		/* Ignore the error. */
+		pr_warn("could not register %s with DevFS\n", name);
+	} else {
+		/* It was registered okay. */
+		set_bit(PLX905X_STATUS_DEVNAME_REGISTERED, status);
+	}
+}
+
+static void
+plx905x_devfs_unregister(unsigned int minor, const char *name,
+			 unsigned long *status)
+{
+	if (!test_and_clear_bit(PLX905X_STATUS_DEVNAME_REGISTERED, status)) {
+		return;
+	}
+#if defined(KCOMPAT_HAVE_DEVFS_24)
+	/* Unregister device with DevFS (for 2.4 kernels). */
+	devfs_unregister(devfs_find_handle(NULL, name, major, minor,
+					   DEVFS_SPECIAL_CHR, 0));
+#elif defined(KCOMPAT_HAVE_DEVFS_26)
+	/* Unregister device with DevFS (early 2.6 kernels). */
+	devfs_remove("%s", name);
+#endif
+}
+#else
+static inline void
+plx905x_devfs_register(unsigned int minor, const char *name,
+		       unsigned long *status)
+{
+}
+
+static inline void
+plx905x_devfs_unregister(unsigned int minor, const char *name,
+			 unsigned long *status)
+{
+}
+#endif
+
+/*
+ * Register or unregister the control device, which has no PCI device.
+ * Failure is not fatal; only broadcast programming is unavailable.
+ */
+static void
+plx905x_ctl_register(void)
+{
+	plx905x_devfs_register(PLX905X_CTL_MINOR, CTL_DEVICE_NAME,
+			       &plx905x_ctl_status);
+#ifdef KCOMPAT_NO_CLASS_DEVICE
+	plx905x_ctl_csdev =
+		device_create(plx905x_class, NULL,
+			      MKDEV(major, PLX905X_CTL_MINOR), NULL,
+			      CTL_DEVICE_NAME);
+#else
+	plx905x_ctl_csdev =
+		class_device_create(plx905x_class, NULL,
+				    MKDEV(major, PLX905X_CTL_MINOR), NULL,
+				    CTL_DEVICE_NAME);
+#endif
+	if (IS_ERR(plx905x_ctl_csdev)) {
+		plx905x_ctl_csdev = NULL;
+	}
+	if (!plx905x_ctl_csdev) {
+		pr_warn("could not register %s with SysFS\n", CTL_DEVICE_NAME);
+	}
+}
+
+static void
+plx905x_ctl_unregister(void)
+{
+	if (plx905x_ctl_csdev) {
+#ifdef KCOMPAT_NO_CLASS_DEVICE
+		device_unregister(plx905x_ctl_csdev);
+#else
+		class_device_unregister(plx905x_ctl_csdev);
+#endif
+		plx905x_ctl_csdev = NULL;
 	}
+	plx905x_devfs_unregister(PLX905X_CTL_MINOR, CTL_DEVICE_NAME,
+				 &plx905x_ctl_status);
+}
+
+/*
+ * Mark a device as gone, so that open files can no longer access the
+ * hardware, and wake anyone waiting for the user-space access lock.
+ */
+static void
+plx905x_kill(struct plx905x_dev *dev)
+{
+	mutex_lock(&dev->mutex);
+	set_bit(PLX905X_STATUS_GONE, &dev->status);
+	plx905x_end_orphans(dev);
+	mutex_unlock(&dev->mutex);
+	wake_up_all(&dev->lock_wait);
+}
 
-	retval = eeprom_cmd_write_enable(dev);
-	if (retval) {
-		goto out;
+/*
+ * Unregister a device from SysFS.
+ */
+static void
+plx905x_csdev_unregister(struct plx905x_dev *dev)
+{
+#ifdef KCOMPAT_NO_CLASS_DEVICE
+	struct device *csdev = dev->csdev;
+#else
+	struct class_device *csdev = dev->csdev;
+#endif
+
+	if (!csdev) {
+		return;
 	}
+	mutex_lock(&dev->mutex);
+	dev->csdev = NULL;
+	mutex_unlock(&dev->mutex);
+#if defined(KCOMPAT_NO_CLASS_DEVICE) && !defined(KCOMPAT_USE_CLASS_DEV_GROUPS)
+	sysfs_remove_group(&csdev->kobj, &plx905x_attr_group);
+#endif
+#ifdef KCOMPAT_NO_CLASS_DEVICE
+	device_unregister(csdev);
+#else
+	class_device_unregister(csdev);
+#endif
+}
 
-	for (addr = *f_pos, n = 0; n < count; addr++, n++) {
-		u8 byte;
+/*
+ * Bring up EEPROM access to a device: bind the bit-bang engine, measure
+ * the bus, detect the EEPROM size, train the clock and choose the access
+ * engine.  This takes a while, so it is normally done in the background
+ * after the device has been registered.
+ */
+static int
+plx905x_bringup(struct plx905x_dev *dev)
+{
+	/* Bind bit-bang engine variant. */
+	plx905x_select_bitops(dev);
 
-		if (((n == 0) && ((addr&1) != 0))
-				|| ((count - n == 1) && ((addr&1) == 0))) {
-			/* Modifying half a 16-bit word at a boundary. */
-			retval = eeprom_cmd_read_word(dev, addr>>1, &data);
-			if (retval) {
-				break;
-			}
-		}
-		/* Get data from user in little-endian order. */
-		__get_user(byte, buf++);
-		if ((addr&1) == 0) {
-			data = (data & 0xFF00) | byte;
-		} else {
-			data = (data & 0x00FF) | (byte << 8);
-		}
-		if (((addr&1) != 0) || (count - n == 1)) {
-			/* Write 16-bit word to EEPROM. */
-			retval = eeprom_cmd_write_word(dev, addr>>1, data);
-			if (retval) {
-				if (((addr&1) != 0) && (n > 0)) {
-					n--;
-					addr--;
-				}
-				break;
+	/* Measure bus access times and set up delays. */
+	plx905x_calibrate(dev);
+	eeprom_update_delays(dev);
+
+	/* Detect EEPROM size if not specified. */
+	if (dev->detect_max) {
+		size_t size = dev->eeprom_size;
+
+		if (plx905x_detect_eeprom(dev, dev->detect_min,
+					  dev->detect_max)) {
+			if (dev->detect_min < CS56_EEPROM_SIZE) {
+				/* No default for PCI9060/9080. */
+				plxdev_err(dev, "must specify valid EEPROM "
+					   "type for PLX PCI%04X\n",
+					   dev->model);
+				return -ENODEV;
 			}
+			plxdev_warn(dev, "assuming %u-byte EEPROM\n",
+				    (unsigned int)size);
+			dev->eeprom_size = size;
+			dev->eeprom_addr_len = CS56_EEPROM_ADDR_LEN;
 		}
+		plx905x_select_bitops(dev);
 	}
 
-	ret = eeprom_cmd_write_disable(dev);
-	if (!retval) {
-		retval = ret;
+	if (clock_ns) {
+		plx905x_set_clock(dev, clock_ns);
+	} else if (train) {
+		plx905x_train_clock(dev);
 	}
 
-	if (n) {
-		retval = n;
-		*f_pos += n;
+	/* Choose EEPROM access engine. */
+	switch (dev->model) {
+	case 0x9030:
+	case 0x9054:
+	case 0x9056:
+	case 0x9656:
+		plx905x_setup_engine(dev, dev->engine_sel);
+		break;
+	default:
+		if (dev->engine_sel == PLX905X_ENGINE_VPD) {
+			plxdev_warn(dev, "VPD engine not supported by "
+				    "PLX PCI%04X\n", dev->model);
+		}
+		break;
 	}
 
-out:
-	mutex_unlock(&dev->mutex);
-	return retval;
+	return 0;
 }
 
-static loff_t
-plx905x_llseek(struct file *filp, loff_t off, int whence)
+#ifdef KCOMPAT_HAVE_LINUX_WORKQUEUE_H
+/*
+ * Fill the RAM copy of the EEPROM contents a unit at a time, giving way
+ * to other users of the device in between, so that reads issued in the
+ * meantime only wait for the words they need.  Give up if user space
+ * takes the access lock, because that discards the RAM copy anyway.
+ */
+static void
+plx905x_warmup(struct plx905x_dev *dev)
 {
-	struct plx905x_dev *dev = filp->private_data;
-	loff_t pos;
+	unsigned int offset = 0;
+	unsigned int nwords;
+	int rc = 0;
 
-	switch (whence) {
-	case 0:	/* SEEK_SET */
-		pos = 0;
-		break;
-	case 1:	/* SEEK_CUR */
-		pos = filp->f_pos;
-		break;
-	case 2:	/* SEEK_END */
-		pos = dev->eeprom_size;
-		break;
-	default:	/* cannot happen */
-		return -EINVAL;
+	while (!rc) {
+		mutex_lock(&dev->mutex);
+		if (test_bit(PLX905X_STATUS_GONE, &dev->status) ||
+		    dev->lock_owner || !dev->use_cache ||
+		    test_bit(PLX905X_STATUS_CACHE_VALID, &dev->status) ||
+		    offset >= (dev->eeprom_size >> 1)) {
+			mutex_unlock(&dev->mutex);
+			break;
+		}
+		plx905x_hold_start(dev);
+		nwords = min_t(unsigned int, (dev->eeprom_size >> 1) - offset,
+			       (eeprom_read_unit(dev, offset * 2) + 1) / 2);
+		set_bit(PLX905X_STATUS_CNTRL_STALE, &dev->status);
+		rc = eeprom_cache_fill(dev, offset, nwords);
+		plx905x_hold_end(dev);
+		mutex_unlock(&dev->mutex);
+		offset += nwords;
+		cond_resched();
 	}
-	pos += off;
-	if ((pos < 0) || (pos > dev->eeprom_size)) {
-		return -EINVAL;
+	if (rc) {
+		csdev_warn(dev->csdev, "EEPROM warm-up failed (%d)\n", rc);
 	}
-	filp->f_pos = pos;
-	return pos;
 }
 
-static struct file_operations plx905x_fops = {
-	.owner = THIS_MODULE,
-	.llseek = plx905x_llseek,
-	.read = plx905x_read,
-	.write = plx905x_write,
-	.open = plx905x_open,
-	.release = plx905x_release,
-};
+/*
+ * Bring up EEPROM access if not done already, then warm up the RAM copy
+ * of the EEPROM contents.
+ */
+static void
+plx905x_bringup_work(struct work_struct *work)
+{
+	struct plx905x_dev *dev =
+		container_of(work, struct plx905x_dev, bringup_work);
+	int rc;
 
-static int __init
-plx905x_module_init(void)
+	if (!completion_done(&dev->ready)) {
+		mutex_lock(&dev->mutex);
+		rc = plx905x_bringup(dev);
+		mutex_unlock(&dev->mutex);
+		if (rc) {
+			plxdev_err(dev, "%s not usable\n", dev->name);
+			plx905x_kill(dev);
+		}
+		complete_all(&dev->ready);
+	}
+	if (warmup) {
+		plx905x_warmup(dev);
+	}
+}
+#endif
+
+static int __devinit
+plx905x_probe(struct pci_dev *pcidev, const struct pci_device_id *id)
 {
-	struct pci_dev *pcidev = NULL;
-	int inst = 0;
-	unsigned int dev_vendor = PCI_ANY_ID;
-	unsigned int dev_device = PCI_ANY_ID;
-	unsigned int dev_subvendor = PCI_ANY_ID;
-	unsigned int dev_subdevice = PCI_ANY_ID;
+	struct plx905x_dev *dev;
 	resource_size_t baraddr, barsize;
 	unsigned int barflags;
-	unsigned int dev_bus = 0;
-	unsigned int dev_slot = 0;
+	unsigned int minor;
 	int rc = 0;
 	unsigned model = 0;
+	const struct plx905x_timing_profile *profile;
+	int engine_sel = -1;
+	size_t detect_min = 0;
+	size_t detect_max = 0;
+	int deferred = 0;
 
-	pr_info("%s, %s\n", DRIVER_DESC, DRIVER_VERSION);
-	if (!bus && !slot) {
-		if (vendor == PCI_ANY_ID && device == PCI_ANY_ID) {
-			vendor = PLX_VENDOR_ID;
-			switch (plx) {
-			case 9030:
-			case 0x9030:
-				device = PLX9030_DEVICE_ID;
-				break;
-			case 9050:
-			case 0x9050:
-			case 9052:
-			case 0x9052:
-				device = PLX9050_DEVICE_ID;
-				break;
-			case 9054:
-			case 0x9054:
-				device = PLX9054_DEVICE_ID;
-				break;
-			case 9056:
-			case 0x9056:
-				device = PLX9056_DEVICE_ID;
-				break;
-			case 9060:
-			case 0x9060:
-				device = PLX9060_DEVICE_ID;
-				break;
-			case 9080:
-			case 0x9080:
-				device = PLX9080_DEVICE_ID;
-				break;
-			case 9656:
-			case 0x9656:
-				device = PLX9656_DEVICE_ID;
-				break;
-			default:
-				device = DEFAULT_DEVICE_ID;
-				break;
-			}
-		}
+	/* Apply PCI location from module parameters. */
+	if ((bus || slot) &&
+	    (bus != pcidev->bus->number || slot != PCI_SLOT(pcidev->devfn))) {
+		return -ENODEV;
 	}
-
-	while ((pcidev = pci_get_subsys(vendor, device, subvendor, subdevice,
-					pcidev)) != NULL) {
-		if (bus || slot) {
-			if (bus != pcidev->bus->number ||
-			    slot != PCI_SLOT(pcidev->devfn)) {
-				continue;
-			}
-		}
-		if (pcidev->hdr_type != PCI_HEADER_TYPE_NORMAL) {
-			continue;
-		}
-		if (++inst > instance) {
-			/* Found required instance. */
-			break;
-		}
-		if (bus || slot) {
-			/* Ignore instance if bus or slot specified. */
-			break;
-		}
+	if (pcidev->hdr_type != PCI_HEADER_TYPE_NORMAL) {
+		return -ENODEV;
 	}
 
-	if (!pcidev) {
-		pr_err("Could not find PCI device\n");
-		rc = -ENODEV;
-		goto out_fail_find_device;
+	pr_info("%02x:%02x %04x:%04x (%04x:%04x)\n",
+		pcidev->bus->number, PCI_SLOT(pcidev->devfn),
+		pcidev->vendor, pcidev->device,
+		pcidev->subsystem_vendor, pcidev->subsystem_device);
+
+	/* Module parameters were checked on loading. */
+	profile = plx905x_find_timing_profile(timing);
+	if (!plx905x_name_eq(engine, "auto")) {
+		engine_sel = plx905x_find_engine(engine);
 	}
 
-	dev_bus = pcidev->bus->number;
-	dev_slot = PCI_SLOT(pcidev->devfn);
-	dev_vendor = pcidev->vendor;
-	dev_device = pcidev->device;
-	dev_subvendor = pcidev->subsystem_vendor;
-	dev_subdevice = pcidev->subsystem_device;
-	pr_info("%02x:%02x %04x:%04x (%04x:%04x) (%d)\n",
-		dev_bus, dev_slot, dev_vendor, dev_device,
-		dev_subvendor, dev_subdevice, inst - 1);
+	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+	if (!dev) {
+		return -ENOMEM;
+	}
+	kref_init(&dev->kref);
+	dev->pcidev = pci_dev_get(pcidev);
 
 	rc = pci_enable_device(pcidev);
 	if (rc) {
@@ -808,35 +4055,41 @@ plx905x_module_init(void)
 	}
 
 	/* Initialize device. */
-	mutex_init(&plx905x_device.mutex);
-	plx905x_device.pcidev = pcidev;
-	plx905x_device.eeprom_size = CS46_EEPROM_SIZE;
-	plx905x_device.eeprom_addr_len = CS46_EEPROM_ADDR_LEN;
-	plx905x_device.cntrl = PLX9050_CNTRL;	/* Change later for PCI9054 */
-	plx905x_device.cntrl_eemask = PLX9050_EEMASK;
-	plx905x_device.iospace = barflags;
-	plx905x_device.iophys = baraddr;
-	plx905x_device.iosize = barsize;
-	if (plx905x_device.iospace == IORESOURCE_IO) {
+	mutex_init(&dev->mutex);
+	init_waitqueue_head(&dev->lock_wait);
+	INIT_LIST_HEAD(&dev->orphans);
+	dev->eeprom_size = CS46_EEPROM_SIZE;
+	dev->eeprom_addr_len = CS46_EEPROM_ADDR_LEN;
+	dev->cntrl = PLX9050_CNTRL;	/* Change later for PCI9054 */
+	dev->cntrl_eemask = PLX9050_EEMASK;
+	set_bit(PLX905X_STATUS_CNTRL_STALE, &dev->status);
+	dev->twp_us = EEPROM_TWP_INIT_US;
+	dev->use_cache = (cache != 0);
+	dev->timing_name = profile->name;
+	dev->timing = profile->timing;
+	dev->iospace = barflags;
+	dev->iophys = baraddr;
+	dev->iosize = barsize;
+	if (dev->iospace == IORESOURCE_IO) {
 		/* Get PCI I/O space. */
-		if (!request_region(plx905x_device.iophys,
-				    plx905x_device.iosize, DRIVER_NAME)) {
+		if (!request_region(dev->iophys,
+				    dev->iosize, DRIVER_NAME)) {
 			pr_err("I/O port busy\n");
 			rc = -EIO;
 			goto out_fail_request_region;
 		}
-		plx905x_device.u.iobase = plx905x_device.iophys;
+		dev->u.iobase = dev->iophys;
 	} else {
 		/* Get PCI memory space. */
-		if (!request_mem_region(plx905x_device.iophys,
-					plx905x_device.iosize, DRIVER_NAME)) {
+		if (!request_mem_region(dev->iophys,
+					dev->iosize, DRIVER_NAME)) {
 			pr_err("I/O port busy\n");
 			rc = -EIO;
 			goto out_fail_request_region;
 		}
-		plx905x_device.u.mmbase =
-			ioremap(plx905x_device.iophys, plx905x_device.iosize);
-		if (plx905x_device.u.mmbase == 0) {
+		dev->u.mmbase =
+			ioremap(dev->iophys, dev->iosize);
+		if (dev->u.mmbase == 0) {
 			pr_err("cannot map I/O mem\n");
 			rc = -ENOMEM;
 			goto out_fail_ioremap;
@@ -845,7 +4098,7 @@ plx905x_module_init(void)
 	/* Set return value for further errors. */
 	rc = -ENODEV;
 	/* Examine device to determine model. */
-	if (plx905x_device.iosize == 128) {
+	if (dev->iosize == 128) {
 		/* Check for PCI9030/9050/9052 */
 		u8 rev;
 		u8 pvpdcntl;
@@ -865,7 +4118,7 @@ plx905x_module_init(void)
 		 * Check for PCI9030.  PCIBAR0 must be 128 bytes memory
 		 * and its PVDCNTL register must be 0x03
 		 */
-		if (plx905x_device.iospace != IORESOURCE_IO &&
+		if (dev->iospace != IORESOURCE_IO &&
 		    pvpdcntl == 0x03) {
 			model = 0x9030;
 		} else {
@@ -888,9 +4141,9 @@ plx905x_module_init(void)
 		int hrev_okay = 0;
 		char *suffix = "";
 
-		plx905x_device.cntrl = PLX9054_CNTRL;
-		hidr = readl(plx905x_device.u.mmbase + PLX9054_PCIHIDR);
-		hrev = readb(plx905x_device.u.mmbase + PLX9054_PCIHREV);
+		dev->cntrl = PLX9054_CNTRL;
+		hidr = readl(dev->u.mmbase + PLX9054_PCIHIDR);
+		hrev = readb(dev->u.mmbase + PLX9054_PCIHREV);
 		/* Check for supported type and revision. */
 		switch (hidr) {
 		case PLX9054_PCIHIDR_VALUE:
@@ -900,7 +4153,7 @@ plx905x_module_init(void)
 			}
 			break;
 		case PLX9056_PCIHIDR_VALUE:
-			plx905x_device.cntrl_eemask = PLX9056_EEMASK;
+			dev->cntrl_eemask = PLX9056_EEMASK;
 			model = 0x9056;
 			hrev_okay = 1;
 			break;
@@ -920,7 +4173,7 @@ plx905x_module_init(void)
 			hrev_okay = 1;
 			break;
 		case PLX9656_PCIHIDR_VALUE:
-			plx905x_device.cntrl_eemask = PLX9056_EEMASK;
+			dev->cntrl_eemask = PLX9056_EEMASK;
 			model = 0x9656;
 			if (hrev >= 0xAA) {
 				hrev_okay = 1;
@@ -1002,8 +4255,8 @@ plx905x_module_init(void)
 		case 128:
 		case 1024:
 		case 0:	/* default to CS46 */
-			plx905x_device.eeprom_size = CS46_EEPROM_SIZE;
-			plx905x_device.eeprom_addr_len = CS46_EEPROM_ADDR_LEN;
+			dev->eeprom_size = CS46_EEPROM_SIZE;
+			dev->eeprom_addr_len = CS46_EEPROM_ADDR_LEN;
 			break;
 		default: /* invalid */
 			pr_err("invalid EEPROM type for PLX PCI%04X\n", model);
@@ -1015,18 +4268,21 @@ plx905x_module_init(void)
 	case 0x9056:
 	case 0x9656:
 		switch (eeprom) {
+		case 0: /* detect, else default to CS56 */
+			detect_min = CS56_EEPROM_SIZE;
+			detect_max = CS66_EEPROM_SIZE;
+			/* fall through */
 		case 56: /* CS56 */
 		case 256:
 		case 2048:
-		case 0:	/* default to CS56 */
-			plx905x_device.eeprom_size = CS56_EEPROM_SIZE;
-			plx905x_device.eeprom_addr_len = CS56_EEPROM_ADDR_LEN;
+			dev->eeprom_size = CS56_EEPROM_SIZE;
+			dev->eeprom_addr_len = CS56_EEPROM_ADDR_LEN;
 			break;
 		case 66: /* CS66 */
 		case 512:
 		case 4096:
-			plx905x_device.eeprom_size = CS66_EEPROM_SIZE;
-			plx905x_device.eeprom_addr_len = CS66_EEPROM_ADDR_LEN;
+			dev->eeprom_size = CS66_EEPROM_SIZE;
+			dev->eeprom_addr_len = CS66_EEPROM_ADDR_LEN;
 			break;
 		default: /* invalid */
 			pr_err("invalid EEPROM type for PLX PCI%04X\n", model);
@@ -1037,17 +4293,23 @@ plx905x_module_init(void)
 	case 0x9080:
 		/* No default EEPROM size for PCI9060/9080 */
 		switch (eeprom) {
+		case 0: /* detect */
+			detect_min = CS46_EEPROM_SIZE;
+			detect_max = CS56_EEPROM_SIZE;
+			dev->eeprom_size = CS56_EEPROM_SIZE;
+			dev->eeprom_addr_len = CS56_EEPROM_ADDR_LEN;
+			break;
 		case 46: /* CS46 */
 		case 128:
 		case 1024:
-			plx905x_device.eeprom_size = CS46_EEPROM_SIZE;
-			plx905x_device.eeprom_addr_len = CS46_EEPROM_ADDR_LEN;
+			dev->eeprom_size = CS46_EEPROM_SIZE;
+			dev->eeprom_addr_len = CS46_EEPROM_ADDR_LEN;
 			break;
 		case 56: /* CS56 */
 		case 256:
 		case 2048:
-			plx905x_device.eeprom_size = CS56_EEPROM_SIZE;
-			plx905x_device.eeprom_addr_len = CS56_EEPROM_ADDR_LEN;
+			dev->eeprom_size = CS56_EEPROM_SIZE;
+			dev->eeprom_addr_len = CS56_EEPROM_ADDR_LEN;
 			break;
 		default: /* invalid */
 			pr_err("must specify valid EEPROM type for PLX PCI%04X\n",
@@ -1059,71 +4321,67 @@ plx905x_module_init(void)
 		pr_err("bug %s[%ld]\n", __FILE__, (long)__LINE__);
 		goto out_fail_eeprom_type;
 	}
-	/* Try to register character device driver. */
-	rc = register_chrdev(major, DRIVER_NAME, &plx905x_fops);
-	if (rc < 0) {
-		pr_err("cannot get major number\n");
-		goto out_fail_register_chrdev;
-	}
-	if (major == 0) {
-		major = rc; 	/* dynamic */
+	/* Bring up EEPROM access now unless it is to be done later. */
+	dev->model = model;
+	dev->engine_sel = engine_sel;
+	dev->detect_min = detect_min;
+	dev->detect_max = detect_max;
+	init_completion(&dev->ready);
+	/* The sysfs attributes may use the bit-bang engine before then. */
+	plx905x_select_bitops(dev);
+#ifdef KCOMPAT_HAVE_LINUX_WORKQUEUE_H
+	KCOMPAT_INIT_WORK(&dev->bringup_work, plx905x_bringup_work);
+	deferred = (async != 0);
+#endif
+	if (!deferred) {
+		if (plx905x_bringup(dev)) {
+			goto out_fail_eeprom_type;
+		}
+		complete_all(&dev->ready);
 	}
-	rc = 0;
-	pr_info("major %d\n", major);
 
-	/* Register sysfs class (for 2.6 or later kernel). */
-	plx905x_class = class_create(CLASS_NAME);
-	if (IS_ERR(plx905x_class)) {
-		rc = PTR_ERR(plx905x_class);
-		pr_err("failed to register SysFS class\n");
-		goto out_fail_class_create;
+	/* Allocate minor device number. */
+	mutex_lock(&plx905x_devs_mutex);
+	for (minor = 0; minor < PLX905X_MAX_DEVICES; minor++) {
+		if (!plx905x_devs[minor]) {
+			break;
+		}
 	}
-
-#ifdef CONFIG_DEVFS_FS
-#if defined(KCOMPAT_HAVE_DEVFS_24)
-	/* Register single device with DevFS (for 2.4 kernels). */
-	if (!devfs_register(NULL, DEVICE_PREFIX, DEVFS_FL_DEFAULT, major, 0,
-			    (S_IFCHR | S_IRUSR | S_IWUSR),
-			    (struct file_operations *)&plx905x_fops, NULL)) {
-		/* Error number is not accurate. */
-		rc = -EINVAL;
+	if (minor < PLX905X_MAX_DEVICES) {
+		dev->minor = minor;
+		plx905x_devs[minor] = dev;
 	}
-#elif defined(KCOMPAT_HAVE_DEVFS_26)
-	/* Register single device with DevFS (for early 2.6 kernels). */
-	rc = devfs_mk_cdev(MKDEV(major, 0), (S_IFCHR | S_IRUSR | S_IWUSR),
-			   DEVICE_PREFIX);
-#endif
-	if (rc) {
-		/* Ignore the error. */
-		pr_warn("could not register with DevFS\n");
-	} else {
-		/* It was registered okay. */
-		set_bit(PLX905X_STATUS_DEVNAME_REGISTERED,
-			&plx905x_device.status);
+	mutex_unlock(&plx905x_devs_mutex);
+	if (minor >= PLX905X_MAX_DEVICES) {
+		pr_err("too many devices\n");
+		rc = -ENOSPC;
+		goto out_fail_minor;
 	}
-#endif
+
+	sprintf(dev->name, DEVICE_PREFIX "%u", dev->minor);
+	plx905x_devfs_register(dev->minor, dev->name, &dev->status);
 
 	/*
-	 * Register single device with SysFS if supported by the kernel.
-	 * Even if not supported, it should get faked by our kernel
-	 * compatibility stuff.
+	 * Register device with SysFS if supported by the kernel.  Even if
+	 * not supported, it should get faked by our kernel compatibility
+	 * stuff.
 	 */
 #ifdef KCOMPAT_NO_CLASS_DEVICE
-	plx905x_device.csdev =
-		device_create(plx905x_class,
-			      KCOMPAT_PCI_TO_DEVICE_PTR(plx905x_device.pcidev),
-			      MKDEV(major, 0), &plx905x_device, DEVICE_PREFIX);
+	dev->csdev =
+		device_create(plx905x_class, KCOMPAT_PCI_TO_DEVICE_PTR(pcidev),
+			      MKDEV(major, dev->minor), dev, "%s", dev->name);
 #else
-	plx905x_device.csdev =
-		class_device_create(plx905x_class, NULL, MKDEV(major, 0),
-				    KCOMPAT_PCI_TO_DEVICE_PTR(plx905x_device.pcidev),
-				    DEVICE_PREFIX);
+	dev->csdev =
+		class_device_create(plx905x_class, NULL,
+				    MKDEV(major, dev->minor),
+				    KCOMPAT_PCI_TO_DEVICE_PTR(pcidev),
+				    "%s", dev->name);
 #endif
-	if (!plx905x_device.csdev) {
+	if (!dev->csdev) {
 		rc = -ENODEV;
-	} else if (IS_ERR(plx905x_device.csdev)) {
-		rc = PTR_ERR(plx905x_device.csdev);
-		plx905x_device.csdev = NULL;
+	} else if (IS_ERR(dev->csdev)) {
+		rc = PTR_ERR(dev->csdev);
+		dev->csdev = NULL;
 	} else {
 		rc = 0;
 	}
@@ -1131,54 +4389,51 @@ plx905x_module_init(void)
 		pr_err("could not register with SysFS\n");
 		goto out_fail_class_device_create;
 	}
-
-	pr_info("okay\n");
-
-	return 0;
-
-	if (plx905x_device.csdev) {
+#if defined(KCOMPAT_NO_CLASS_DEVICE) && !defined(KCOMPAT_USE_CLASS_DEV_GROUPS)
+	rc = sysfs_create_group(&dev->csdev->kobj, &plx905x_attr_group);
+	if (rc) {
+		pr_err("could not create SysFS attributes\n");
 #ifdef KCOMPAT_NO_CLASS_DEVICE
-		device_unregister(plx905x_device.csdev);
+		device_unregister(dev->csdev);
 #else
-		class_device_unregister(plx905x_device.csdev);
+		class_device_unregister(dev->csdev);
 #endif
+		dev->csdev = NULL;
+		goto out_fail_class_device_create;
 	}
-out_fail_class_device_create:
-
-#ifdef CONFIG_DEVFS_FS
-	if (test_bit(PLX905X_STATUS_DEVNAME_REGISTERED,
-		     &plx905x_device.status)) {
-#if defined(KCOMPAT_HAVE_DEVFS_24)
-		/* Unregister single device with DevFS (for 2.4 kernels). */
-		devfs_unregister(devfs_find_handle(NULL, DEVICE_PREFIX,
-				 major, 0, DEVFS_SPECIAL_CHR, 0));
-#elif defined(KCOMPAT_HAVE_DEVFS_26)
-		/* Unregister single device with DevFS (early 2.6 kernels). */
-		devfs_remove(DEVICE_PREFIX);
 #endif
+
+	pci_set_drvdata(pcidev, dev);
+	pr_info("okay (%s)\n", dev->name);
+#ifdef KCOMPAT_HAVE_LINUX_WORKQUEUE_H
+	if (deferred || (warmup && dev->use_cache)) {
+		kcompat_queue_long_work(&dev->bringup_work);
 	}
 #endif
 
-	/* Unregister sysfs class (for 2.6 kernel). */
-	class_destroy(plx905x_class);
-out_fail_class_create:
-
-	unregister_chrdev(major, DRIVER_NAME);
-out_fail_register_chrdev:
+	return 0;
 
+out_fail_class_device_create:
+	plx905x_devfs_unregister(dev->minor, dev->name, &dev->status);
+	mutex_lock(&plx905x_devs_mutex);
+	plx905x_devs[dev->minor] = NULL;
+	mutex_unlock(&plx905x_devs_mutex);
+	/* The device file may have been opened in the meantime. */
+	plx905x_kill(dev);
+	complete_all(&dev->ready);
+out_fail_minor:
 out_fail_eeprom_type:
 out_fail_plx_model:
 
-	if (plx905x_device.iospace == IORESOURCE_MEM) {
-		iounmap((void *)plx905x_device.u.mmbase);
+	if (dev->iospace == IORESOURCE_MEM) {
+		iounmap((void *)dev->u.mmbase);
 	}
 out_fail_ioremap:
 
-	if (plx905x_device.iospace == IORESOURCE_MEM) {
-		release_mem_region(plx905x_device.iophys,
-				   plx905x_device.iosize);
+	if (dev->iospace == IORESOURCE_MEM) {
+		release_mem_region(dev->iophys, dev->iosize);
 	} else {
-		release_region(plx905x_device.iophys, plx905x_device.iosize);
+		release_region(dev->iophys, dev->iosize);
 	}
 #ifndef KCOMPAT_PCI_ENABLE_DEVICE_IS_REF_COUNTED
 	/* pci_disable_device only called if request regions successful. */
@@ -1194,50 +4449,148 @@ out_fail_plx_resource_check:
 #endif
 out_fail_pci_enable_device:
 
-	/* pci_get_subsys() increments a reference.  Decrement it. */
-	pci_dev_put(pcidev);
-out_fail_find_device:
+	kref_put(&dev->kref, plx905x_dev_release);
 	return rc;
 }
 
-static void __exit
-plx905x_module_exit(void)
+static void __devexit
+plx905x_remove(struct pci_dev *pcidev)
 {
-	pr_info("exit\n");
+	struct plx905x_dev *dev = pci_get_drvdata(pcidev);
 
-	if (plx905x_device.csdev) {
-#ifdef KCOMPAT_NO_CLASS_DEVICE
-		device_unregister(plx905x_device.csdev);
-#else
-		class_device_unregister(plx905x_device.csdev);
+	/* Stop new opens, then cut off existing ones from the hardware. */
+	mutex_lock(&plx905x_devs_mutex);
+	plx905x_devs[dev->minor] = NULL;
+	mutex_unlock(&plx905x_devs_mutex);
+	plx905x_kill(dev);
+#ifdef KCOMPAT_HAVE_LINUX_WORKQUEUE_H
+	cancel_work_sync(&dev->bringup_work);
 #endif
+	complete_all(&dev->ready);
+	plx905x_csdev_unregister(dev);
+	plx905x_devfs_unregister(dev->minor, dev->name, &dev->status);
+
+	if (dev->iospace == IORESOURCE_IO) {
+		release_region(dev->iophys, dev->iosize);
+	} else {
+		iounmap((void *)dev->u.mmbase);
+		release_mem_region(dev->iophys, dev->iosize);
 	}
+	pci_disable_device(pcidev);
+	pci_set_drvdata(pcidev, NULL);
+	kref_put(&dev->kref, plx905x_dev_release);
+}
 
-#ifdef CONFIG_DEVFS_FS
-	if (test_bit(PLX905X_STATUS_DEVNAME_REGISTERED,
-		     &plx905x_device.status)) {
-#if defined(KCOMPAT_HAVE_DEVFS_24)
-		/* Unregister single device with DevFS (for 2.4 kernels). */
-		devfs_unregister(devfs_find_handle(NULL, DEVICE_PREFIX,
-				 major, 0, DEVFS_SPECIAL_CHR, 0));
-#elif defined(KCOMPAT_HAVE_DEVFS_26)
-		/* Unregister single device with DevFS (early 2.6 kernels). */
-		devfs_remove(DEVICE_PREFIX);
+static struct pci_driver plx905x_pci_driver = {
+	.name = DRIVER_NAME,
+	.id_table = plx905x_pci_table,
+	.probe = plx905x_probe,
+	.remove = __devexit_p(plx905x_remove),
+};
+
+static int __init
+plx905x_module_init(void)
+{
+	struct pci_device_id *id;
+	int rc = 0;
+
+	pr_info("%s, %s\n", DRIVER_DESC, DRIVER_VERSION);
+	if (!plx905x_find_timing_profile(timing)) {
+		pr_err("invalid timing profile '%s'\n", timing);
+		return -EINVAL;
+	}
+	if (clock_ns > EEPROM_MAX_DELAY_NS) {
+		pr_err("invalid clock_ns %u\n", clock_ns);
+		return -EINVAL;
+	}
+	if (!plx905x_name_eq(engine, "auto") &&
+	    plx905x_find_engine(engine) < 0) {
+		pr_err("invalid engine '%s'\n", engine);
+		return -EINVAL;
+	}
+
+	/*
+	 * Match the PCI IDs given by module parameters (if any) as well as
+	 * the factory default IDs.  If just the PCI location is given, match
+	 * any device there.
+	 */
+	if (vendor != PCI_ANY_ID || device != PCI_ANY_ID ||
+	    subvendor != PCI_ANY_ID || subdevice != PCI_ANY_ID ||
+	    bus || slot) {
+		id = &plx905x_pci_table[ARRAY_SIZE(plx905x_pci_table) - 2];
+		id->vendor = vendor;
+		id->device = device;
+		id->subvendor = subvendor;
+		id->subdevice = subdevice;
+		if (!bus && !slot &&
+		    vendor == PCI_ANY_ID && device == PCI_ANY_ID) {
+			id->vendor = PLX_VENDOR_ID;
+		}
+	}
+
+	/* Try to register character device driver. */
+	rc = register_chrdev(major, DRIVER_NAME, &plx905x_fops);
+	if (rc < 0) {
+		pr_err("cannot get major number\n");
+		goto out_fail_register_chrdev;
+	}
+	if (major == 0) {
+		major = rc; 	/* dynamic */
+	}
+	rc = 0;
+	pr_info("major %d\n", major);
+
+	/* Register sysfs class (for 2.6 or later kernel). */
+	plx905x_class = class_create(CLASS_NAME);
+	if (IS_ERR(plx905x_class)) {
+		rc = PTR_ERR(plx905x_class);
+		pr_err("failed to register SysFS class\n");
+		goto out_fail_class_create;
+	}
+#ifdef KCOMPAT_USE_CLASS_DEV_GROUPS
+	/* Attributes are created along with the device. */
+	plx905x_class->dev_groups = plx905x_attr_groups;
 #endif
+
+	plx905x_ctl_register();
+
+#ifdef KCOMPAT_HAVE_DRIVER_PROBE_TYPE
+	if (async) {
+		/* Do not hold up the loading of the module. */
+		plx905x_pci_driver.driver.probe_type =
+			PROBE_PREFER_ASYNCHRONOUS;
 	}
 #endif
+	rc = pci_register_driver(&plx905x_pci_driver);
+	if (rc < 0) {
+		pr_err("failed to register PCI driver\n");
+		goto out_fail_pci_register_driver;
+	}
+
+	return 0;
+
+out_fail_pci_register_driver:
+
+	plx905x_ctl_unregister();
 
+	/* Unregister sysfs class (for 2.6 kernel). */
+	class_destroy(plx905x_class);
+out_fail_class_create:
+
+	unregister_chrdev(major, DRIVER_NAME);
+out_fail_register_chrdev:
+	return rc;
+}
+
+static void __exit
+plx905x_module_exit(void)
+{
+	pr_info("exit\n");
+
+	pci_unregister_driver(&plx905x_pci_driver);
+	plx905x_ctl_unregister();
 	class_destroy(plx905x_class);
 	unregister_chrdev(major, DRIVER_NAME);
-	if (plx905x_device.iospace == IORESOURCE_IO) {
-		release_region(plx905x_device.iophys, plx905x_device.iosize);
-	} else {
-		iounmap((void *)plx905x_device.u.mmbase);
-		release_mem_region(plx905x_device.iophys,
-				plx905x_device.iosize);
-	}
-	pci_disable_device(plx905x_device.pcidev);
-	pci_dev_put(plx905x_device.pcidev);
 }
 
 module_init(plx905x_module_init);
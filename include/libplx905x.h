@@ -0,0 +1,81 @@
+/*
+ * PLX PCI905x serial EEPROM user-space access library.
+ *
+ * Copyright (C) 2025 The plx905x-eeprom contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * A copy of the GNU General Public License may be found in the file
+ * "COPYING".
+ */
+
+/*
+ * The library drives the serial EEPROM directly through the PLX chip's
+ * CNTRL register, mapped from the PCI device's sysfs "resource" file, so
+ * that EEPROM operations do not need a system call each.  The plx905x
+ * driver must be loaded; it provides the device information and an
+ * advisory lock so that the driver and the library never drive the CNTRL
+ * register at the same time.
+ *
+ * Functions returning int return 0 on success, or -1 with errno set on
+ * failure.  EEPROM operations fail with ENOLCK unless the lock is held.
+ */
+
+#ifndef LIBPLX905X_H__INCLUDED
+#define LIBPLX905X_H__INCLUDED
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct plx905x_eeprom;
+
+/*
+ * Open the EEPROM of the PLX chip handled by the driver's device file
+ * (e.g. "/dev/plx905x0").  Returns NULL with errno set on failure.
+ */
+struct plx905x_eeprom *plx905x_eeprom_open(const char *devname);
+
+/* Close the EEPROM, releasing the lock if held. */
+void plx905x_eeprom_close(struct plx905x_eeprom *ee);
+
+/* Get the EEPROM size in bytes. */
+unsigned int plx905x_eeprom_size(const struct plx905x_eeprom *ee);
+
+/*
+ * Take or release the lock shared with the driver.  Taking the lock waits
+ * for the driver to finish any EEPROM access in progress.
+ */
+int plx905x_eeprom_lock(struct plx905x_eeprom *ee);
+int plx905x_eeprom_unlock(struct plx905x_eeprom *ee);
+
+/* Read a range of 16-bit words with a single sequential READ command. */
+int plx905x_eeprom_read_words(struct plx905x_eeprom *ee, unsigned int offset,
+			      uint16_t *data, unsigned int nwords);
+
+/* Write-enable (EWEN) or write-disable (EWDS) the EEPROM. */
+int plx905x_eeprom_write_enable(struct plx905x_eeprom *ee);
+int plx905x_eeprom_write_disable(struct plx905x_eeprom *ee);
+
+/*
+ * Write a 16-bit word and wait for it to be programmed.  The EEPROM must
+ * be write-enabled.
+ */
+int plx905x_eeprom_write_word(struct plx905x_eeprom *ee, unsigned int offset,
+			      uint16_t data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* LIBPLX905X_H__INCLUDED */
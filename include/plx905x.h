@@ -0,0 +1,138 @@
+/*
+ * PLX PCI905x serial EEPROM driver - user-space interface.
+ *
+ * Copyright (C) 2025 The plx905x-eeprom contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * A copy of the GNU General Public License may be found in the file
+ * "COPYING".
+ */
+
+#ifndef PLX905X_H__INCLUDED
+#define PLX905X_H__INCLUDED
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define PLX905X_IOCTL_MAGIC	0xB5
+
+/* Maximum number of devices handled by the driver. */
+#define PLX905X_MAX_DEVICES	16
+
+/*
+ * PLX905X_IOCTL_WRITE_SESSION - start or end a write session.
+ *
+ * The argument is an integer value, not a pointer.  A non-zero value
+ * starts a write session on the open file.  Zero ends the write session
+ * after programming any buffered data.
+ *
+ * During a write session, the EEPROM is write-enabled once and left
+ * enabled.  Data written to the file is buffered in a RAM image of the
+ * EEPROM contents taken at the start of the session, and reads from the
+ * file return data from that image.  Buffered data is programmed into
+ * the EEPROM by fsync() or when the session ends.  The session ends when
+ * the file is closed if it has not been ended explicitly.
+ */
+#define PLX905X_IOCTL_WRITE_SESSION	_IO(PLX905X_IOCTL_MAGIC, 0)
+
+/*
+ * PLX905X_IOCTL_ERASE_ALL - erase the whole EEPROM.
+ *
+ * Sets every word of the EEPROM to 0xFFFF in a single programming cycle
+ * using the ERAL command.  There is no argument.
+ *
+ * PLX905X_IOCTL_WRITE_ALL - fill the whole EEPROM with a pattern.
+ *
+ * The argument is an integer value, not a pointer.  Sets every word of
+ * the EEPROM to the 16-bit argument value in a single programming cycle
+ * using the WRAL command.
+ *
+ * Both requests fail with EBUSY while another open file has a write
+ * session.  Data buffered by a write session on the same file is
+ * discarded.
+ */
+#define PLX905X_IOCTL_ERASE_ALL		_IO(PLX905X_IOCTL_MAGIC, 1)
+#define PLX905X_IOCTL_WRITE_ALL		_IO(PLX905X_IOCTL_MAGIC, 2)
+
+/*
+ * PLX905X_IOCTL_RELOAD - reload the PLX chip's configuration.
+ *
+ * Makes the PLX chip reload its configuration registers from the EEPROM,
+ * so that changes take effect without a reboot.  Data buffered by a write
+ * session on the same file is programmed first.  There is no argument.
+ */
+#define PLX905X_IOCTL_RELOAD		_IO(PLX905X_IOCTL_MAGIC, 3)
+
+/*
+ * PLX905X_IOCTL_LOCK - take the user-space access lock.
+ * PLX905X_IOCTL_UNLOCK - release the user-space access lock.
+ *
+ * There is no argument.  While an open file holds the lock, the driver
+ * does not access the PLX chip's CNTRL register for any other open file or
+ * sysfs attribute; they wait until the lock is released.  This allows a
+ * user-space program to drive the EEPROM through the CNTRL register
+ * itself (see PLX905X_IOCTL_GET_INFO).  PLX905X_IOCTL_LOCK waits until
+ * the driver has finished any EEPROM access in progress.  The lock is
+ * released automatically when the file is closed.  The driver discards
+ * its RAM copy of the EEPROM contents when the lock is released.
+ */
+#define PLX905X_IOCTL_LOCK		_IO(PLX905X_IOCTL_MAGIC, 4)
+#define PLX905X_IOCTL_UNLOCK		_IO(PLX905X_IOCTL_MAGIC, 5)
+
+/*
+ * PLX905X_IOCTL_GET_INFO - get information for user-space access.
+ *
+ * The argument points to a struct plx905x_info, which is filled in.
+ */
+struct plx905x_info {
+	__u32 pci_domain;	/* PCI domain of the PLX chip */
+	__u32 pci_bus;		/* PCI bus number */
+	__u32 pci_devfn;	/* PCI device and function number */
+	__u32 bar;		/* PCI BAR of local configuration registers */
+	__u32 bar_is_io;	/* non-zero if the BAR is in I/O space */
+	__u32 cntrl;		/* offset of CNTRL register within the BAR */
+	__u32 eemask;		/* CNTRL register bits used for the EEPROM */
+	__u32 eeprom_size;	/* EEPROM size in bytes */
+	__u32 eeprom_addr_len;	/* number of EEPROM address bits */
+	__u32 sk_low_ns;	/* Microwire timing parameters (ns) */
+	__u32 sk_high_ns;
+	__u32 cs_low_ns;
+	__u32 do_valid_ns;
+};
+
+#define PLX905X_IOCTL_GET_INFO	\
+	_IOR(PLX905X_IOCTL_MAGIC, 6, struct plx905x_info)
+
+/*
+ * PLX905X_IOCTL_PROGRAM_ALL - program an image into several devices.
+ *
+ * Only supported by the control device (e.g. "/dev/plx905xctl"), which
+ * must be open for writing.  The argument points to a struct
+ * plx905x_program_all.  The image is written from offset 0 of each
+ * selected device as if written to its device file, and the devices are
+ * programmed at the same time.  On return, the status array holds 0 for
+ * each device programmed successfully (or not selected) and a negative
+ * error number for each device that failed, for example -ENODEV if there
+ * is no such device or -ENOSPC if the image is larger than its EEPROM.
+ * The request fails with EIO if any selected device failed.
+ */
+struct plx905x_program_all {
+	__u64 image;		/* user-space address of the image */
+	__u32 size;		/* image size in bytes */
+	__u32 mask;		/* bit N selects device N (e.g. /dev/plx905xN) */
+	__s32 status[PLX905X_MAX_DEVICES];	/* per-device result */
+};
+
+#define PLX905X_IOCTL_PROGRAM_ALL	\
+	_IOWR(PLX905X_IOCTL_MAGIC, 7, struct plx905x_program_all)
+
+#endif	/* PLX905X_H__INCLUDED */
@@ -0,0 +1,423 @@
+/*
+ * PLX PCI905x serial EEPROM user-space access library.
+ *
+ * Copyright (C) 2025 The plx905x-eeprom contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * A copy of the GNU General Public License may be found in the file
+ * "COPYING".
+ */
+
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "plx905x.h"
+#include "libplx905x.h"
+
+/*
+ * CNTRL register bits, as in the driver.
+ */
+#define EE_SK	0x01000000
+#define EE_CS	0x02000000
+#define EE_DI	0x04000000	/* from EEPROM's point of view */
+#define EE_DO	0x08000000
+#define EE_DOE	0x80000000	/* for PCI9056 */
+
+/* Programming cycle polling limits. */
+#define EEPROM_TWP_POLL_US	50
+#define EEPROM_TWP_TIMEOUT_MS	50
+
+struct plx905x_eeprom {
+	int devfd;		/* driver's device file */
+	int resfd;		/* sysfs resource file */
+	void *map;		/* mapping of memory BAR */
+	size_t maplen;
+	volatile uint32_t *cntrlp;	/* CNTRL register in mapping */
+	struct plx905x_info info;
+	int locked;
+	uint32_t cntrl;		/* shadow copy of CNTRL register */
+	struct timespec edge;	/* time of last CNTRL write */
+};
+
+static uint32_t
+cntrl_read(struct plx905x_eeprom *ee)
+{
+	uint32_t val = 0;
+
+	if (ee->cntrlp) {
+		return le32toh(*ee->cntrlp);
+	}
+	/* I/O BAR resource files transfer dwords in host order. */
+	if (pread(ee->resfd, &val, 4, ee->info.cntrl) != 4) {
+		val = 0;
+	}
+	return val;
+}
+
+static void
+cntrl_write(struct plx905x_eeprom *ee, uint32_t val)
+{
+	if (ee->cntrlp) {
+		*ee->cntrlp = htole32(val);
+	} else if (pwrite(ee->resfd, &val, 4, ee->info.cntrl) != 4) {
+		/* Nothing useful to do. */
+	}
+	ee->cntrl = val;
+	clock_gettime(CLOCK_MONOTONIC, &ee->edge);
+}
+
+/*
+ * Busy-wait until at least 'ns' nanoseconds after the last CNTRL write.
+ * The time taken by the write itself counts towards the delay.
+ */
+static void
+edge_delay(struct plx905x_eeprom *ee, unsigned int ns)
+{
+	struct timespec end = ee->edge;
+	struct timespec now;
+
+	end.tv_nsec += ns;
+	while (end.tv_nsec >= 1000000000) {
+		end.tv_nsec -= 1000000000;
+		end.tv_sec++;
+	}
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (now.tv_sec < end.tv_sec ||
+		 (now.tv_sec == end.tv_sec && now.tv_nsec < end.tv_nsec));
+}
+
+/* Assert CS and send the start bit. */
+static void
+eeprom_start_cmd(struct plx905x_eeprom *ee)
+{
+	uint32_t cn = ee->cntrl;
+
+	cn = (cn & ~EE_SK) | ((EE_CS | EE_DI | EE_DOE) & ee->info.eemask);
+	cntrl_write(ee, cn);
+	edge_delay(ee, ee->info.sk_low_ns);
+	cntrl_write(ee, cn | EE_SK);
+	edge_delay(ee, ee->info.sk_high_ns);
+}
+
+/* Deassert CS. */
+static void
+eeprom_end_cmd(struct plx905x_eeprom *ee)
+{
+	uint32_t cn = ee->cntrl;
+
+	cn &= ~((EE_CS | EE_SK | EE_DI | EE_DOE) & ee->info.eemask);
+	cntrl_write(ee, cn);
+	edge_delay(ee, ee->info.cs_low_ns);
+}
+
+/* Send a few bits. */
+static void
+eeprom_put_bits(struct plx905x_eeprom *ee, unsigned int bits,
+		unsigned int nbits)
+{
+	uint32_t cn = ee->cntrl;
+
+	while (nbits--) {
+		if (bits & (1 << nbits)) {
+			cn |= ((EE_DI | EE_DOE) & ee->info.eemask);
+		} else {
+			cn &= ~((EE_DI | EE_DOE) & ee->info.eemask);
+		}
+		cn &= ~EE_SK;
+		cntrl_write(ee, cn);
+		edge_delay(ee, ee->info.sk_low_ns);
+		cn |= EE_SK;
+		cntrl_write(ee, cn);
+		edge_delay(ee, ee->info.sk_high_ns);
+	}
+}
+
+/* Wait for programming cycle to complete. */
+static int
+eeprom_wait_prog(struct plx905x_eeprom *ee)
+{
+	uint32_t cn = ee->cntrl;
+	unsigned int waited_us = 0;
+	int retval = -1;
+
+	cn = (cn & ~EE_SK) | ((EE_CS | EE_DI | EE_DOE) & ee->info.eemask);
+	cntrl_write(ee, cn);
+	for (;;) {
+		usleep(EEPROM_TWP_POLL_US);
+		waited_us += EEPROM_TWP_POLL_US;
+		if (cntrl_read(ee) & EE_DO) {
+			/* Cycle complete.  Clear ready status. */
+			cntrl_write(ee, cn | EE_SK);
+			edge_delay(ee, ee->info.sk_high_ns);
+			retval = 0;
+			break;
+		}
+		if (waited_us >= EEPROM_TWP_TIMEOUT_MS * 1000) {
+			errno = EIO;
+			break;
+		}
+	}
+	eeprom_end_cmd(ee);
+	return retval;
+}
+
+static int
+check_locked(struct plx905x_eeprom *ee)
+{
+	if (!ee->locked) {
+		errno = ENOLCK;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Map the CNTRL register.  Memory BARs are mapped with mmap().  I/O BARs
+ * cannot be mapped, so the resource file is accessed with pread() and
+ * pwrite() instead.
+ */
+static int
+map_cntrl(struct plx905x_eeprom *ee)
+{
+	char path[80];
+	char line[160];
+	unsigned long long start = 0, end, flags;
+	unsigned int i;
+	long pagesize = sysconf(_SC_PAGESIZE);
+	size_t pgoff;
+	FILE *f;
+
+	snprintf(path, sizeof(path),
+		 "/sys/bus/pci/devices/%04x:%02x:%02x.%x/resource",
+		 ee->info.pci_domain, ee->info.pci_bus,
+		 ee->info.pci_devfn >> 3, ee->info.pci_devfn & 7);
+	/* Find offset of BAR start within its page. */
+	f = fopen(path, "r");
+	if (!f) {
+		return -1;
+	}
+	for (i = 0; i <= ee->info.bar; i++) {
+		if (!fgets(line, sizeof(line), f) ||
+		    sscanf(line, "%llx %llx %llx", &start, &end, &flags) != 3) {
+			fclose(f);
+			errno = ENODEV;
+			return -1;
+		}
+	}
+	fclose(f);
+	snprintf(path + strlen(path), sizeof(path) - strlen(path), "%u",
+		 ee->info.bar);
+	ee->resfd = open(path, O_RDWR | O_CLOEXEC);
+	if (ee->resfd < 0) {
+		return -1;
+	}
+	if (ee->info.bar_is_io) {
+		return 0;
+	}
+	pgoff = start & (pagesize - 1);
+	ee->maplen = (pgoff + ee->info.cntrl + 4 + pagesize - 1) &
+		     ~(size_t)(pagesize - 1);
+	ee->map = mmap(NULL, ee->maplen, PROT_READ | PROT_WRITE, MAP_SHARED,
+		       ee->resfd, 0);
+	if (ee->map == MAP_FAILED) {
+		ee->map = NULL;
+		return -1;
+	}
+	ee->cntrlp = (volatile uint32_t *)((char *)ee->map + pgoff +
+					   ee->info.cntrl);
+	return 0;
+}
+
+struct plx905x_eeprom *
+plx905x_eeprom_open(const char *devname)
+{
+	struct plx905x_eeprom *ee;
+	int err;
+
+	ee = calloc(1, sizeof(*ee));
+	if (!ee) {
+		return NULL;
+	}
+	ee->resfd = -1;
+	ee->devfd = open(devname, O_RDWR | O_CLOEXEC);
+	if (ee->devfd < 0) {
+		goto fail;
+	}
+	if (ioctl(ee->devfd, PLX905X_IOCTL_GET_INFO, &ee->info) < 0) {
+		goto fail;
+	}
+	if (map_cntrl(ee) < 0) {
+		goto fail;
+	}
+	return ee;
+
+fail:
+	err = errno;
+	plx905x_eeprom_close(ee);
+	errno = err;
+	return NULL;
+}
+
+void
+plx905x_eeprom_close(struct plx905x_eeprom *ee)
+{
+	if (!ee) {
+		return;
+	}
+	if (ee->map) {
+		munmap(ee->map, ee->maplen);
+	}
+	if (ee->resfd >= 0) {
+		close(ee->resfd);
+	}
+	if (ee->devfd >= 0) {
+		/* Closing the device file releases the lock. */
+		close(ee->devfd);
+	}
+	free(ee);
+}
+
+unsigned int
+plx905x_eeprom_size(const struct plx905x_eeprom *ee)
+{
+	return ee->info.eeprom_size;
+}
+
+int
+plx905x_eeprom_lock(struct plx905x_eeprom *ee)
+{
+	if (ioctl(ee->devfd, PLX905X_IOCTL_LOCK) < 0) {
+		return -1;
+	}
+	ee->locked = 1;
+	ee->cntrl = cntrl_read(ee);
+	clock_gettime(CLOCK_MONOTONIC, &ee->edge);
+	return 0;
+}
+
+int
+plx905x_eeprom_unlock(struct plx905x_eeprom *ee)
+{
+	if (check_locked(ee) < 0) {
+		return -1;
+	}
+	ee->locked = 0;
+	return ioctl(ee->devfd, PLX905X_IOCTL_UNLOCK) < 0 ? -1 : 0;
+}
+
+int
+plx905x_eeprom_read_words(struct plx905x_eeprom *ee, unsigned int offset,
+			  uint16_t *data, unsigned int nwords)
+{
+	unsigned int size = ee->info.eeprom_size >> 1;
+	uint32_t cn;
+	uint16_t d;
+	int i;
+	int retval = 0;
+
+	if (check_locked(ee) < 0) {
+		return -1;
+	}
+	if (offset >= size || nwords > size - offset) {
+		errno = ENXIO;
+		return -1;
+	}
+	if (nwords == 0) {
+		return 0;
+	}
+	eeprom_start_cmd(ee);
+	eeprom_put_bits(ee, 0x2, 2);
+	eeprom_put_bits(ee, offset, ee->info.eeprom_addr_len);
+	edge_delay(ee, ee->info.do_valid_ns);
+	/* Check dummy bit DO==0. */
+	if (cntrl_read(ee) & EE_DO) {
+		errno = EIO;
+		retval = -1;
+		goto out;
+	}
+	cn = ee->cntrl | ((EE_DI | EE_DOE) & ee->info.eemask);
+	while (nwords--) {
+		/* Read 16 data bits m.s.b. first. */
+		d = 0;
+		for (i = 0; i < 16; i++) {
+			d <<= 1;
+			cn &= ~EE_SK;
+			cntrl_write(ee, cn);
+			edge_delay(ee, ee->info.sk_low_ns);
+			cn |= EE_SK;
+			cntrl_write(ee, cn);
+			edge_delay(ee, ee->info.do_valid_ns);
+			if (cntrl_read(ee) & EE_DO) {
+				d |= 1;
+			}
+		}
+		*data++ = d;
+	}
+out:
+	eeprom_end_cmd(ee);
+	return retval;
+}
+
+int
+plx905x_eeprom_write_enable(struct plx905x_eeprom *ee)
+{
+	if (check_locked(ee) < 0) {
+		return -1;
+	}
+	eeprom_start_cmd(ee);
+	eeprom_put_bits(ee, 0x3, 4);
+	eeprom_put_bits(ee, 0, ee->info.eeprom_addr_len - 2);
+	eeprom_end_cmd(ee);
+	return 0;
+}
+
+int
+plx905x_eeprom_write_disable(struct plx905x_eeprom *ee)
+{
+	if (check_locked(ee) < 0) {
+		return -1;
+	}
+	eeprom_start_cmd(ee);
+	eeprom_put_bits(ee, 0, ee->info.eeprom_addr_len + 2);
+	eeprom_end_cmd(ee);
+	return 0;
+}
+
+int
+plx905x_eeprom_write_word(struct plx905x_eeprom *ee, unsigned int offset,
+			  uint16_t data)
+{
+	if (check_locked(ee) < 0) {
+		return -1;
+	}
+	if (offset >= (ee->info.eeprom_size >> 1)) {
+		errno = ENXIO;
+		return -1;
+	}
+	eeprom_start_cmd(ee);
+	eeprom_put_bits(ee, 0x1, 2);
+	eeprom_put_bits(ee, offset, ee->info.eeprom_addr_len);
+	eeprom_put_bits(ee, data, 16);
+	eeprom_end_cmd(ee);
+	return eeprom_wait_prog(ee);
+}